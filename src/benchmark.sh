@@ -0,0 +1,103 @@
+#!/bin/bash
+# Benchmarks the reader on synthetic worst-case images, and compares against the stored baseline.
+# usage: src/benchmark.sh [--save] [runs] [seed]
+#
+# The images come from `fat_12_disk_reader mkbench`, so the same seed always gives the same images.
+# Every command is run $runs times on every image. Reported per pair:
+#   the median wall time, and throughput as image bytes / median time,
+#   I/O calls and peak RSS from --stats.
+# "I/O calls" is read + map + advise + write calls, as counted by the reader itself. It stands in for a
+# syscall count, and needs no strace. Medians and I/O calls are both compared against the baseline.
+# --save writes the results as the new baseline. The baseline is only meaningful on the machine it was made on.
+set -e
+
+reader=bin/fat_12_disk_reader
+baseline=src/benchmark_baseline.txt
+save=0
+if [ "$1" = "--save" ]; then
+    save=1
+    shift
+fi
+runs=${1:-5}
+seed=${2:-1}
+
+shapes=(fragmented full-root deep long-names fill)
+commands=(dump json analyze extract stream)
+
+mkdir -p bin/bench
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+run_command() {
+    # run_command <command> <image> [extra reader flags]...
+    local command=$1 image=$2
+    shift 2
+    case $command in
+        dump)    "$reader" "$@" "$image" ;;
+        json)    "$reader" "$@" --format=json "$image" ;;
+        analyze) "$reader" "$@" "$image" analyze ;;
+        extract) rm -rf "$scratch/out"; "$reader" "$@" "$image" extract "$scratch/out" ;;
+        stream)  "$reader" "$@" --stream < "$image" ;;
+    esac
+}
+
+results=()
+printf "%-11s %-8s %10s %10s %9s %9s %8s %9s\n" shape command median_ms MB/s io_calls rss_kB change io_calls+
+for shape in "${shapes[@]}"; do
+    image=bin/bench/$shape.img
+    "$reader" mkbench "$image" "$shape" "$seed" > /dev/null
+    image_bytes=$(stat -c %s "$image")
+
+    for command in "${commands[@]}"; do
+        # analyze exits non-zero when it finds a problem, which isn't a failure here.
+        times=()
+        for ((run = 0; run < runs; run++)); do
+            start=$(date +%s%N)
+            run_command "$command" "$image" > /dev/null 2>&1 || true
+            end=$(date +%s%N)
+            times+=($((end - start)))
+        done
+        median_ns=$(printf "%s\n" "${times[@]}" | sort -n | awk '{ value[NR] = $1 } END { print value[int((NR + 1) / 2)] }')
+
+        # --stats prints JSON when the command already uses --format=json.
+        run_command "$command" "$image" --stats 2> "$scratch/stats" > /dev/null || true
+        rss_kb=$(grep -oE '(Peak RSS *: |"peak_rss_kb":)[0-9]+' "$scratch/stats" | grep -oE '[0-9]+$')
+        io_calls=$(awk -F': *' '
+            /^(Read|Write) Calls/ { split($2, value, " "); total += value[1] }
+            /^Map \/ Advise Calls/ { split($2, value, " / "); total += value[1] + value[2] }
+            {
+                while(match($0, /"(read|map|advise|write)_calls":[0-9]+/)) {
+                    counter = substr($0, RSTART, RLENGTH)
+                    sub(/.*:/, "", counter)
+                    total += counter
+                    $0 = substr($0, RSTART + RLENGTH)
+                }
+            }
+            END { print total + 0 }' "$scratch/stats")
+
+        median_ms=$(awk -v ns="$median_ns" 'BEGIN { printf "%.3f", ns / 1e6 }')
+        throughput=$(awk -v ns="$median_ns" -v bytes="$image_bytes" 'BEGIN { printf "%.1f", (ns > 0 ? bytes / (ns / 1e9) / 1e6 : 0) }')
+
+        change=-
+        io_calls_change=-
+        if [ -f "$baseline" ]; then
+            change=$(awk -v shape="$shape" -v command="$command" -v now="$median_ms" \
+                '$1 == shape && $2 == command && $3 > 0 { printf "%+.1f%%", (now - $3) / $3 * 100 }' "$baseline")
+            change=${change:--}
+            io_calls_change=$(awk -v shape="$shape" -v command="$command" -v now="$io_calls" \
+                '$1 == shape && $2 == command && $5 ~ /^[0-9]+$/ { printf "%+d", now - $5 }' "$baseline")
+            io_calls_change=${io_calls_change:--}
+        fi
+
+        printf "%-11s %-8s %10s %10s %9s %9s %8s %9s\n" "$shape" "$command" "$median_ms" "$throughput" "$io_calls" "$rss_kb" "$change" "$io_calls_change"
+        results+=("$shape $command $median_ms $throughput $io_calls $rss_kb")
+    done
+done
+
+if [ $save -eq 1 ]; then
+    {
+        echo "# shape command median_ms MB/s io_calls rss_kB (runs=$runs seed=$seed)"
+        printf "%s\n" "${results[@]}"
+    } > "$baseline"
+    echo "Saved baseline to $baseline"
+fi
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Times boot-to-kernel under QEMU, for a few kernel sizes.
+# usage: src/boot_benchmark.sh [runs]
+#
+# Each kernel is src/kernel.asm padded out to the size, on an image with the bootloader from bin/bootloader.bin.
+# The kernel ends QEMU through isa-debug-exit as soon as it runs, so the wall time of QEMU is
+# QEMU startup + BIOS + the bootloader loading the kernel. The smallest kernel is one sector, so
+# "load_ms" (the median minus the smallest kernel's median) is about the time spent loading the rest.
+set -e
+
+reader=bin/fat_12_disk_reader
+runs=${1:-10}
+sizes=(512 16384 61440)
+qemu=${QEMU:-qemu-system-i386}
+
+mkdir -p bin/boot_bench
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+boot_once() {
+    # (0x10 << 1) | 1 from the kernel. Anything else means it never got there.
+    local status=0
+    timeout 10 "$qemu" -display none -no-reboot \
+        -drive file="$1",format=raw,if=floppy -boot a \
+        -device isa-debug-exit,iobase=0xf4,iosize=0x04 > /dev/null 2>&1 || status=$?
+    if [ $status -ne 33 ]; then
+        echo "$1 didn't boot to the kernel (QEMU exit status $status)" >&2
+        exit 1
+    fi
+}
+
+first_median_ns=
+printf "%-12s %10s %10s\n" kernel_bytes median_ms load_ms
+for size in "${sizes[@]}"; do
+    image=bin/boot_bench/kernel_$size.img
+    mkdir -p "$scratch/root"
+    nasm src/kernel.asm -f bin -D KERNEL_SIZE=$size -o "$scratch/root/KERNEL.BIN"
+    "$reader" mkimage "$image" bin/bootloader.bin "$scratch/root" / > /dev/null
+
+    times=()
+    for ((run = 0; run < runs; run++)); do
+        start=$(date +%s%N)
+        boot_once "$image"
+        end=$(date +%s%N)
+        times+=($((end - start)))
+    done
+    median_ns=$(printf "%s\n" "${times[@]}" | sort -n | awk '{ value[NR] = $1 } END { print value[int((NR + 1) / 2)] }')
+    first_median_ns=${first_median_ns:-$median_ns}
+
+    printf "%-12s %10s %10s\n" "$size" \
+        "$(awk -v ns="$median_ns" 'BEGIN { printf "%.3f", ns / 1e6 }')" \
+        "$(awk -v ns="$median_ns" -v first="$first_median_ns" 'BEGIN { printf "%.3f", (ns - first) / 1e6 }')"
+done
@@ -1,9 +1,27 @@
 // accept fat-12 img file as command line argument
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // BIOS Parameter Block aka. Boot Record
 typedef struct {
@@ -57,7 +75,7 @@ typedef struct {
     uint8_t long_entry_type;
     uint8_t checksum;
     unsigned char name_2[12];
-    uint8_t always_zero;
+    uint16_t always_zero;
     unsigned char name_3[4];
 } __attribute__((packed)) LongFileNameEntry;
 
@@ -69,35 +87,361 @@ typedef union {
 // Doesn't seem that useful.
 // typedef uint8_t Sector[512];
 
-FILE *image_file = NULL;
+// A run of clusters that sit next to each other in the Data Section.
+// mcopy usually lays files out contiguously, so most chains are a single extent.
+typedef struct {
+    int first_cluster_number;
+    int cluster_count;
+} ClusterExtent;
+
+typedef struct {
+    ClusterExtent *extents;
+    int extents_count;
+    int extents_capacity;
+    int clusters_count;
+
+    // The FAT value that stopped the walk: >= 0xFF8 end of chain, 0xFF7 bad cluster, 0 / 1 reserved.
+    // is_looped is set if the walk stopped because it visited more clusters than the FAT has.
+    uint16_t last_table_value;
+    int is_looped;
+} ClusterChain;
+
+// Read-only view of the whole image.
+// Normally it's an mmap of the file, so every section is just a pointer into it.
+// If the input can't be mapped (pipes, character devices, ...), it's read into the heap once instead.
+typedef struct {
+    int fd;
+    const uint8_t *data;
+    size_t size;
+    int is_mapped;
+} ImageMapping;
+
 
 const int bytes_name_1 = 2 * 5;
 const int bytes_name_2 = 2 * 6;
 const int bytes_name_3 = 2 * 2;
 const int bytes_per_lfn_entry = bytes_name_1 + bytes_name_2 + bytes_name_3;
 
-int sectors_in_reserved_section;
-int sectors_in_fat_section;
-int sectors_in_root_directory;
-int sectors_in_data_section;
+// Longest name is 255 UTF-16 chars, which needs 20 LFN entries.
+#define MAX_LFN_ENTRIES 20
+#define MAX_NAME_LENGTH 255
+// In UTF-8 a UTF-16 code unit takes at most 3 bytes (a surrogate pair is 2 units and 4 bytes).
+#define MAX_NAME_UTF8_LENGTH (MAX_NAME_LENGTH * 3)
+
+// All normal output goes through a big buffer, and is written out in bulk.
+// printf once per byte of file data was the slowest part of a full dump.
+// Errors still go to stderr directly.
+typedef struct {
+    int fd;
+    char *data;
+    size_t size;
+    size_t capacity;
+} OutputBuffer;
+
+#define OUTPUT_BUFFER_CAPACITY (256 * 1024)
+
+// Counters for --stats. They're atomics because extract and batch workers bump them at the same time.
+// Relaxed adds are enough, nobody reads them until the workers are done.
+typedef enum {
+    REGION_RESERVED,
+    REGION_FAT,
+    REGION_ROOT_DIRECTORY,
+    REGION_DATA,
+    REGIONS_COUNT
+} ImageRegion;
+
+typedef enum {
+    PHASE_BOOT_RECORD,
+    PHASE_FAT,
+    PHASE_ROOT_DIRECTORY,
+    PHASE_SUBDIRECTORIES,
+    PHASE_CHAIN_WALK,
+    PHASES_COUNT
+} Phase;
+
+typedef struct {
+    atomic_ullong read_calls;
+    atomic_ullong map_calls;
+    atomic_ullong advise_calls;
+    atomic_ullong write_calls;
+    atomic_ullong bytes_read;
+    atomic_ullong bytes_written;
+
+    // How much of each region was handed out by image_bytes(), and in how many pieces.
+    // With the mapping that's what actually got touched, not what the kernel paged in.
+    atomic_ullong region_bytes[REGIONS_COUNT];
+    atomic_ullong region_accesses[REGIONS_COUNT];
+
+    atomic_ullong chains_resolved;
+    atomic_ullong clusters_followed;
+    atomic_ullong extent_hint_hits;
+    atomic_ullong extent_hint_misses;
+
+    atomic_ullong phase_nanoseconds[PHASES_COUNT];
+} IoStats;
+
+// Only counts when --stats is on, so the normal path pays one NULL check.
+#define STATS_ADD(volume, counter, amount) \
+    do { \
+        if((volume)->stats != NULL) { \
+            atomic_fetch_add_explicit(&(volume)->stats->counter, (amount), memory_order_relaxed); \
+        } \
+    } while(0)
+
+// Set by --stats. Every volume picks it up in init_volume(), so batch mode adds up all its images.
+IoStats *active_io_stats = NULL;
+
+// Everything the reader knows about one image.
+// Nothing is global, so several images can be read at the same time on different threads.
+typedef struct {
+    const char *image_path;
+    ImageMapping image;
+
+    // Both of these point straight into the image mapping.
+    const BootRecord *boot_record;
+    const ExtendedBootRecord *extended_boot_record;
+
+    int sectors_in_reserved_section;
+    int sectors_in_fat_section;
+    int sectors_in_root_directory;
+    int sectors_in_data_section;
+
+    // Everything in the Data Section is addressed in clusters, not sectors.
+    int bytes_per_cluster;
+    int clusters_in_data_section;
+    int directory_entries_per_cluster;
+
+    int first_fat_sector_index;
+    int file_desc_fat_section_offset;
+
+    int file_desc_root_directory_offset;
+
+    int first_data_sector_index;
+    int file_desc_data_section_offset;
+
+    // The first FAT, unpacked once into one uint16_t per cluster.
+    // Following a chain is then just fat_table[cluster].
+    uint16_t *fat_table;
+    int fat_table_entries_count;
+
+    // Count and walk every directory slot, even past the 0x00 end of directory marker. Set with --audit.
+    int full_slot_audit;
+
+    // Only used when the image is opened for writing. The heap copy of the image is the cache,
+    // with one byte per sector that's set when the sector changed since the last flush.
+    uint8_t *dirty_sectors;
+    int sectors_count;
+    int is_fat_dirty;
+
+    // When set, every new entry gets this date and time instead of the real one. mkimage uses it
+    // so the same inputs always give the same image.
+    int has_fixed_timestamp;
+    uint16_t fixed_date;
+    uint16_t fixed_time;
+
+    // NULL unless --stats was given.
+    IoStats *stats;
+
+    OutputBuffer *out;
+} Fat12Volume;
+
+char output_buffer_data[OUTPUT_BUFFER_CAPACITY];
+OutputBuffer output = { STDOUT_FILENO, output_buffer_data, 0, OUTPUT_BUFFER_CAPACITY };
+
+void init_volume(Fat12Volume *volume, OutputBuffer *out) {
+    memset(volume, 0, sizeof(Fat12Volume));
+    volume->image.fd = -1;
+    volume->out = out;
+    volume->stats = active_io_stats;
+}
+
+uint64_t monotonic_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+uint64_t stats_clock(Fat12Volume *volume) {
+    // Nanoseconds on the monotonic clock, or 0 without --stats so nothing gets timed.
+    return volume->stats != NULL ? monotonic_nanoseconds() : 0;
+}
+
+void stats_add_phase(Fat12Volume *volume, Phase phase, uint64_t started) {
+    if(volume->stats == NULL) return;
+    STATS_ADD(volume, phase_nanoseconds[phase], stats_clock(volume) - started);
+}
+
+// Defined further down, next to write_file_data().
+int write_all(int fd, const uint8_t *data, size_t size);
+
+void out_flush(OutputBuffer *out) {
+    // A buffer with no fd just keeps everything in memory, to be written out later.
+    if(out->fd >= 0 && out->size > 0) {
+        write_all(out->fd, (const uint8_t *) out->data, out->size);
+        out->size = 0;
+    }
+}
+
+int out_make_room(OutputBuffer *out, size_t size) {
+    // Returns 1 if size more bytes fit in the buffer now.
+    if(out->size + size < out->capacity) return 1;
+
+    if(out->fd >= 0) {
+        out_flush(out);
+        return size < out->capacity;
+    }
+
+    size_t capacity = out->capacity > 0 ? out->capacity : 4096;
+    while(out->size + size >= capacity) capacity *= 2;
+
+    char *data = (char *) realloc(out->data, capacity);
+    if(data == NULL) return 0;
+    out->data = data;
+    out->capacity = capacity;
+    return 1;
+}
+
+void out_write(OutputBuffer *out, const void *data, size_t size) {
+    // Too big to be worth copying into the buffer. Write it straight out.
+    if(out->fd >= 0 && out->size + size >= out->capacity && size > out->capacity / 2) {
+        out_flush(out);
+        write_all(out->fd, (const uint8_t *) data, size);
+        return;
+    }
+
+    if(!out_make_room(out, size)) return;
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+}
+
+void out_printf(OutputBuffer *out, const char *format, ...) {
+    va_list arguments;
+
+    // Format straight into the free space at the end of the buffer.
+    va_start(arguments, format);
+    int length = out->capacity > out->size
+        ? vsnprintf(out->data + out->size, out->capacity - out->size, format, arguments)
+        : vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+    if(length < 0) return;
+
+    if(out->size + length < out->capacity) {
+        out->size += length;
+        return;
+    }
+
+    // Didn't fit. Make room and try again, or use a temporary buffer if it's huge.
+    char *target = out_make_room(out, length + 1) ? out->data + out->size : (char *) malloc(length + 1);
+    if(target == NULL) return;
+
+    va_start(arguments, format);
+    vsnprintf(target, length + 1, format, arguments);
+    va_end(arguments);
 
-int first_fat_sector_index;
-int file_desc_fat_section_offset;
+    if(target == out->data + out->size) {
+        out->size += length;
+    } else {
+        write_all(out->fd, (const uint8_t *) target, length);
+        free(target);
+    }
+}
+
+int read_whole_image_into_heap(Fat12Volume *volume) {
+    // Fallback for inputs that can't be mapped.
+    // pread when the input is seekable, plain read otherwise (pipes don't support pread).
+    size_t capacity = volume->image.size > 0 ? volume->image.size : 1474560;
+    size_t size = 0;
+    uint8_t *buffer = (uint8_t *) malloc(capacity);
+    int use_pread = 1;
+
+    while(buffer != NULL) {
+        if(size == capacity) {
+            capacity *= 2;
+            uint8_t *bigger = (uint8_t *) realloc(buffer, capacity);
+            if(bigger == NULL) break;
+            buffer = bigger;
+        }
+
+        ssize_t bytes_read = use_pread
+            ? pread(volume->image.fd, buffer + size, capacity - size, size)
+            : read(volume->image.fd, buffer + size, capacity - size);
+        STATS_ADD(volume, read_calls, 1);
+        if(bytes_read > 0) STATS_ADD(volume, bytes_read, bytes_read);
+
+        if(bytes_read < 0 && use_pread) {
+            use_pread = 0;
+            continue;
+        }
+        if(bytes_read <= 0) {
+            volume->image.data = buffer;
+            volume->image.size = size;
+            volume->image.is_mapped = 0;
+            return bytes_read == 0 ? 0 : -1;
+        }
+        size += bytes_read;
+    }
+
+    free(buffer);
+    return -1;
+}
+
+int open_disk_img(Fat12Volume *volume, unsigned char *image_path) {
+    volume->image_path = (const char *) image_path;
+    volume->image.fd = open((const char *) image_path, O_RDONLY);
+    if (volume->image.fd < 0) {
+        fprintf(stderr, "Error: Could not open image file %s\n", image_path);
+        return -1;
+    }
 
-int first_data_sector_index;
-int file_desc_data_section_offset;
+    struct stat image_stat;
+    if(fstat(volume->image.fd, &image_stat) == 0 && S_ISREG(image_stat.st_mode)) {
+        volume->image.size = image_stat.st_size;
+    }
+
+    if(volume->image.size > 0) {
+        void *mapping = mmap(NULL, volume->image.size, PROT_READ, MAP_PRIVATE, volume->image.fd, 0);
+        STATS_ADD(volume, map_calls, 1);
+        if(mapping != MAP_FAILED) {
+            volume->image.data = (const uint8_t *) mapping;
+            volume->image.is_mapped = 1;
+            return 0;
+        }
+    }
+
+    if(read_whole_image_into_heap(volume) != 0) {
+        fprintf(stderr, "Error: Could not read image file %s\n", image_path);
+        return -1;
+    }
+    return 0;
+}
 
-BootRecord boot_record;
-ExtendedBootRecord extended_boot_record;
+ImageRegion region_of_offset(Fat12Volume *volume, size_t offset) {
+    // Before the boot record is parsed, everything counts as reserved.
+    if(volume->boot_record == NULL || offset < (size_t) volume->file_desc_fat_section_offset) return REGION_RESERVED;
+    if(offset < (size_t) volume->file_desc_root_directory_offset) return REGION_FAT;
+    if(offset < (size_t) volume->file_desc_data_section_offset) return REGION_ROOT_DIRECTORY;
+    return REGION_DATA;
+}
+
+void count_region_bytes(Fat12Volume *volume, size_t offset, size_t length) {
+    // A request is counted against the region it starts in. Nothing reads across a region boundary
+    // except the head of the image in stream mode, and that's all metadata anyway.
+    ImageRegion region = region_of_offset(volume, offset);
+    STATS_ADD(volume, region_bytes[region], length);
+    STATS_ADD(volume, region_accesses[region], 1);
+}
 
-void open_disk_img(unsigned char *image_path) {
-    image_file = fopen(image_path, "rb");
-    if (image_file == NULL) {
-        printf("Error: Could not open image file %s\n", image_path);
+const uint8_t *image_bytes(Fat12Volume *volume, size_t offset, size_t length) {
+    // Hands out a pointer into the image, or NULL if [offset, offset + length) runs past the end.
+    // No copies are made, so callers must treat it as read-only.
+    if(offset > volume->image.size || length > volume->image.size - offset) {
+        return NULL;
     }
+    if(volume->stats != NULL) count_region_bytes(volume, offset, length);
+    return volume->image.data + offset;
 }
 
-void print_hex(unsigned char *label, uint8_t *ptr, int size) {
+void print_hex(Fat12Volume *volume, unsigned char *label, const uint8_t *ptr, int size) {
     // I want to read the struct byte-wise.
     // So I get a pointer to the struct.
     // But I need the pointer to advance by 1 Byte at a time.
@@ -111,240 +455,575 @@ void print_hex(unsigned char *label, uint8_t *ptr, int size) {
     // So we can do this neat thing:
     // So tecnically *p = *(p + 0) = p[0]
 
-    printf("%s: \t", label);
+    // Format the whole line locally, and hand it to the output buffer in one go.
+    static const char hex_digits[] = "0123456789ABCDEF";
+    char line[256];
+    int length = snprintf(line, sizeof(line) - 3 * size - 1, "%s: \t", label);
+
     for(int i = 0; i < size; i++) {
-        printf("%02X ", ptr[i]);
+        line[length++] = hex_digits[ptr[i] >> 4];
+        line[length++] = hex_digits[ptr[i] & 0x0F];
+        line[length++] = ' ';
     }
-    printf("\n");
+    line[length++] = '\n';
+    out_write(volume->out, line, length);
 }
 
-void print_decimal(unsigned char *label, uint32_t number) {
-    printf("%s: \t", label);
-    printf("%d\n", number);
+void print_decimal(Fat12Volume *volume, unsigned char *label, uint32_t number) {
+    out_printf(volume->out, "%s: \t%d\n", label, number);
 }
 
-void print_string(unsigned char *label, unsigned char *str, int size) {
-    printf("%s: \t", label);
+void print_string(Fat12Volume *volume, unsigned char *label, const unsigned char *str, int size) {
+    char line[256];
+    int length = snprintf(line, sizeof(line) - size - 1, "%s: \t", label);
 
     for(int i = 0; i < size; i++) {
         if(str[i] == 0x00) {
             continue;
         }
-        printf("%c", str[i]);
+        line[length++] = str[i];
     }
     
-    printf("\n");
+    line[length++] = '\n';
+    out_write(volume->out, line, length);
 }
 
-void print_plain_string(unsigned char *str, int size) {
-    for(int i = 0; i < size; i++) {
-        printf("%c", str[i]);
-    }
+void print_plain_string(Fat12Volume *volume, const unsigned char *str, int size) {
+    // The whole span in one go, instead of one printf per byte.
+    out_write(volume->out, str, size);
 }
 
-void print_long_file_name(unsigned char *label, unsigned char *str, int size) {
-    printf("%s: \t", label);
-    int null_count = 0;
-    int padding_count = 0;
-
-    for(int i = 0; i < size; i++) {
-        // Skip 0x00. It's a NULL character.
-        // Skip 0xFF. It's just padding.
-        // It needs to be casted to unsigned char.
-        // Otherwise, it'll be implicitly casted to int, which is 32-bit wide.
-        // So it'll become FF FF FF FF
-        // Better to use unsigned char everywhere to avoid type issues.
-        if(str[i] == 0xFF) {
-            padding_count++;
-            // printf(" + ");
-            continue;
-        }
-
-        if(str[i] == 0x00) {
-            null_count++;
-            // printf(" - ");
-            continue;
-        }
-
-        // For debugging what the char is.
-        // if(('a' <= str[i] && str[i] <= 'z') || str[i] == '_' || str[i] == '.') {
-        //     printf("%c", str[i]);
-        // } else {
-        //     printf(" %02X ", str[i]);
-        // }
-
-        printf("%c", str[i]);
-    }
-    printf("\n");
-
-    // Just for checking if the null and padding chars are being detected.
-    // printf("Null count: %d\n", null_count);
-    // printf("Padding count: %d\n", padding_count);
-    printf("\n");
+void print_long_file_name(Fat12Volume *volume, unsigned char *label, const char *name) {
+    // Used to print the raw UTF-16 bytes, skipping every 0x00 and 0xFF.
+    // That only worked for ASCII names, so now it gets the name already decoded to UTF-8.
+    out_printf(volume->out, "%s: \t%s\n\n", label, name);
 }
 
-void read_boot_drive_section() {
+int parse_boot_drive_section(Fat12Volume *volume) {
     // First Sector of a drive contain the Boot Drive information for BIOS.
     // FAT 12 considers first Sector as Reserved Section.
     // This section contains the BPB and EBPB information for FAT12 File System.
 
-    fread(&boot_record, sizeof(BootRecord), 1, image_file);
-    fread(&extended_boot_record, sizeof(ExtendedBootRecord), 1, image_file);
-
-    // Chechking few fields to see if the struct is packed correctly.
-    print_hex("JMP SHORT NOP       ", (uint8_t *) &boot_record.jmp_short_nop             , 3);
-    print_hex("OEM IDENTIFIER      ", (uint8_t *) &boot_record.oem_identifier            , 8);
-    print_hex("BYTES PER SECTOR    ", (uint8_t *) &boot_record.bytes_per_sector          , 2);
-    print_hex("SECTORS PER CLUSTER ", (uint8_t *) &boot_record.sectors_per_cluster       , 1);
-    printf("\n");
-
-    print_hex("DRIVE NUMBER        ", (uint8_t *) &extended_boot_record.drive_number         ,  1);
-    print_hex("VOLUME ID           ", (uint8_t *) &extended_boot_record.volume_id            ,  4);
-    print_hex("VOLUME LABEL        ", (uint8_t *) &extended_boot_record.volume_label         , 11);
-    print_hex("SYSTEM IDENTIFIER   ", (uint8_t *) &extended_boot_record.system_identifier    ,  8);
-    print_hex("BOOT SIGNATURE      ", (uint8_t *) &extended_boot_record.boot_signature       ,  2);
-    printf("\n");
+    // Both are fetched before boot_record is set, so --stats counts them as reserved. Once boot_record is set,
+    // region_of_offset() goes by the section offsets, and those aren't worked out yet.
+    const BootRecord *boot_record = (const BootRecord *) image_bytes(volume, 0, sizeof(BootRecord));
+    const ExtendedBootRecord *extended_boot_record = (const ExtendedBootRecord *) image_bytes(volume, sizeof(BootRecord), sizeof(ExtendedBootRecord));
+    if(boot_record == NULL || extended_boot_record == NULL) {
+        fprintf(stderr, "Error: %s: Image is too small to contain a boot record\n", volume->image_path);
+        return -1;
+    }
+    volume->boot_record = boot_record;
+    volume->extended_boot_record = extended_boot_record;
+    // FAT12 allows 512 - 4096 bytes per sector, and a power of 2 sectors per cluster.
+    // Anything else is a broken boot record, and would break the offset math below.
+    if(volume->boot_record->bytes_per_sector < 512 || volume->boot_record->bytes_per_sector > 4096 ||
+       (volume->boot_record->bytes_per_sector & (volume->boot_record->bytes_per_sector - 1)) != 0) {
+        fprintf(stderr, "Error: %s: Boot record has %d bytes per sector\n", volume->image_path, volume->boot_record->bytes_per_sector);
+        return -1;
+    }
+    if(volume->boot_record->sectors_per_cluster == 0 ||
+       (volume->boot_record->sectors_per_cluster & (volume->boot_record->sectors_per_cluster - 1)) != 0) {
+        fprintf(stderr, "Error: %s: Boot record has %d sectors per cluster\n", volume->image_path, volume->boot_record->sectors_per_cluster);
+        return -1;
+    }
 
     // Bytes are read from the volume / storage in units of sectors.
     // So it's better to know how many sectors each sections have.
-    // Ideally these should be clusters_in_x_section, but since custer = sector in this, it's fineeee for now.
-    sectors_in_reserved_section = boot_record.reserved_sectors;
-    sectors_in_fat_section = boot_record.fat_count * boot_record.sectors_per_fat;
+    // The Data Section is the only one addressed in clusters, so it also gets clusters_in_data_section below.
+    volume->sectors_in_reserved_section = volume->boot_record->reserved_sectors;
+    volume->sectors_in_fat_section = volume->boot_record->fat_count * volume->boot_record->sectors_per_fat;
 
     // Round up to nearest sector count.
-    sectors_in_root_directory = ((boot_record.root_dir_entries_count * sizeof(RootDirectoryEntry)) + (boot_record.bytes_per_sector - 1)) / boot_record.bytes_per_sector;
-    sectors_in_data_section = boot_record.total_sectors - (sectors_in_reserved_section + sectors_in_fat_section + sectors_in_root_directory);
+    volume->sectors_in_root_directory = ((volume->boot_record->root_dir_entries_count * sizeof(RootDirectoryEntry)) + (volume->boot_record->bytes_per_sector - 1)) / volume->boot_record->bytes_per_sector;
+    volume->sectors_in_data_section = volume->boot_record->total_sectors - (volume->sectors_in_reserved_section + volume->sectors_in_fat_section + volume->sectors_in_root_directory);
+
+    // A cluster can be several sectors. Every read of the Data Section is a whole cluster.
+    volume->bytes_per_cluster = volume->boot_record->sectors_per_cluster * volume->boot_record->bytes_per_sector;
+    volume->clusters_in_data_section = volume->sectors_in_data_section > 0 ? volume->sectors_in_data_section / volume->boot_record->sectors_per_cluster : 0;
+    volume->directory_entries_per_cluster = volume->bytes_per_cluster / sizeof(RootDirectoryEntry);
 
     // Calculate the offset of FAT Section, Data Section wrt. the start of the Floppyy Disk Image.
-    first_fat_sector_index = sectors_in_reserved_section;
-    file_desc_fat_section_offset = sectors_in_reserved_section * boot_record.bytes_per_sector;
+    volume->first_fat_sector_index = volume->sectors_in_reserved_section;
+    volume->file_desc_fat_section_offset = volume->sectors_in_reserved_section * volume->boot_record->bytes_per_sector;
+    volume->file_desc_root_directory_offset = volume->file_desc_fat_section_offset + volume->sectors_in_fat_section * volume->boot_record->bytes_per_sector;
 
-    first_data_sector_index = sectors_in_reserved_section + sectors_in_fat_section + sectors_in_root_directory;
-    file_desc_data_section_offset = first_data_sector_index * boot_record.bytes_per_sector;
+    volume->first_data_sector_index = volume->sectors_in_reserved_section + volume->sectors_in_fat_section + volume->sectors_in_root_directory;
+    volume->file_desc_data_section_offset = volume->first_data_sector_index * volume->boot_record->bytes_per_sector;
 
-    printf("Sectors in Reserved Section                     : %d\n", sectors_in_reserved_section);
-    printf("Sectors in FAT Section                          : %d\n", sectors_in_fat_section);
-    printf("Sectors in Root Directory                       : %d\n", sectors_in_root_directory);
-    printf("Sectors in Data Section                         : %d\n", sectors_in_data_section);
-    printf("Total Sectors                                   : %d\n", boot_record.total_sectors);
-    printf("File Descriptor Data Sector Offset in Bytes     : %d\n", file_desc_data_section_offset);
+    return 0;
+}
+
+void print_boot_drive_section(Fat12Volume *volume) {
+    // Chechking few fields to see if the struct is packed correctly.
+    print_hex(volume, "JMP SHORT NOP       ", (const uint8_t *) &volume->boot_record->jmp_short_nop             , 3);
+    print_hex(volume, "OEM IDENTIFIER      ", (const uint8_t *) &volume->boot_record->oem_identifier            , 8);
+    print_hex(volume, "BYTES PER SECTOR    ", (const uint8_t *) &volume->boot_record->bytes_per_sector          , 2);
+    print_hex(volume, "SECTORS PER CLUSTER ", (const uint8_t *) &volume->boot_record->sectors_per_cluster       , 1);
+    out_printf(volume->out, "\n");
+
+    print_hex(volume, "DRIVE NUMBER        ", (const uint8_t *) &volume->extended_boot_record->drive_number         ,  1);
+    print_hex(volume, "VOLUME ID           ", (const uint8_t *) &volume->extended_boot_record->volume_id            ,  4);
+    print_hex(volume, "VOLUME LABEL        ", (const uint8_t *) &volume->extended_boot_record->volume_label         , 11);
+    print_hex(volume, "SYSTEM IDENTIFIER   ", (const uint8_t *) &volume->extended_boot_record->system_identifier    ,  8);
+    print_hex(volume, "BOOT SIGNATURE      ", (const uint8_t *) &volume->extended_boot_record->boot_signature       ,  2);
+    out_printf(volume->out, "\n");
+
+    out_printf(volume->out, "Sectors in Reserved Section                     : %d\n", volume->sectors_in_reserved_section);
+    out_printf(volume->out, "Sectors in FAT Section                          : %d\n", volume->sectors_in_fat_section);
+    out_printf(volume->out, "Sectors in Root Directory                       : %d\n", volume->sectors_in_root_directory);
+    out_printf(volume->out, "Sectors in Data Section                         : %d\n", volume->sectors_in_data_section);
+    out_printf(volume->out, "Clusters in Data Section                        : %d\n", volume->clusters_in_data_section);
+    out_printf(volume->out, "Bytes per Cluster                               : %d\n", volume->bytes_per_cluster);
+    out_printf(volume->out, "Total Sectors                                   : %d\n", volume->boot_record->total_sectors);
+    out_printf(volume->out, "File Descriptor Data Sector Offset in Bytes     : %d\n", volume->file_desc_data_section_offset);
+
+    out_printf(volume->out, "\n");
+}
+
+void unpack_fat12_entries(const uint8_t *packed, int packed_size, uint16_t *entries, int entries_count) {
+    // Every 3 bytes hold 2 entries: 0x123, 0x456 is stored as 23 61 45.
+    // Load 8 bytes at a time and pull 4 entries (6 bytes) out of it with shifts.
+    // No branches in the loop, so gcc can keep the whole thing in registers.
+    int i = 0;
+    int byte_offset = 0;
+
+    for(; i + 4 <= entries_count && byte_offset + 8 <= packed_size; i += 4, byte_offset += 6) {
+        uint64_t group;
+        memcpy(&group, packed + byte_offset, sizeof(group));
+
+        entries[i + 0] = (group      ) & 0xFFF;
+        entries[i + 1] = (group >> 12) & 0xFFF;
+        entries[i + 2] = (group >> 24) & 0xFFF;
+        entries[i + 3] = (group >> 36) & 0xFFF;
+    }
+
+    // Whatever is left over, 1 entry at a time.
+    for(; i < entries_count; i++) {
+        int fat12_table_index = i + (i / 2);
+        uint16_t table_value = packed[fat12_table_index] | (packed[fat12_table_index + 1] << 8);
+
+        entries[i] = (i % 2 == 1) ? (table_value >> 4) : (table_value & 0xFFF);
+    }
+}
 
-    printf("\n");
+int read_boot_drive_section(Fat12Volume *volume) {
+    uint64_t started = stats_clock(volume);
+    int status = parse_boot_drive_section(volume);
+    stats_add_phase(volume, PHASE_BOOT_RECORD, started);
+    return status;
 }
 
-void read_file_allocation_table_section() {
+int unpack_file_allocation_table_section(Fat12Volume *volume) {
     // After the Reserved Section is the File Allocation Table Section.
     // There are 2 FAT tables here usually. This is intended for redudancy.
     // Each FAT table contains 9 sectors.
 
-    // This is too much data to read into memory.
-    // Skip over the FAT table section.
-    fseek(image_file, boot_record.fat_count * boot_record.sectors_per_fat * boot_record.bytes_per_sector, SEEK_CUR);
+    // Turns out it's only 9 * 512 = 4.5 KiB. Not too much data to read into memory after all.
+    // Read the first FAT once, and unpack it so every lookup after this is an array index.
+    // The other copies are only for redundancy, so skip over them.
+    int fat_size_in_bytes = volume->boot_record->sectors_per_fat * volume->boot_record->bytes_per_sector;
+
+    const uint8_t *packed_fat = image_bytes(volume, volume->file_desc_fat_section_offset, fat_size_in_bytes);
+    if(packed_fat == NULL) {
+        fprintf(stderr, "Error: %s: Image is too small to contain the FAT\n", volume->image_path);
+        return -1;
+    }
+
+    // 12 bits per entry = 2 entries per 3 bytes.
+    // Only the first 2 + clusters_in_data_section entries refer to real clusters.
+    volume->fat_table_entries_count = (fat_size_in_bytes * 2) / 3;
+    if(volume->fat_table_entries_count > volume->clusters_in_data_section + 2) {
+        volume->fat_table_entries_count = volume->clusters_in_data_section + 2;
+    }
+    volume->fat_table = (uint16_t *) malloc(sizeof(uint16_t) * volume->fat_table_entries_count);
+    if(volume->fat_table == NULL) {
+        fprintf(stderr, "Error: %s: Out of memory for the FAT\n", volume->image_path);
+        return -1;
+    }
+    unpack_fat12_entries(packed_fat, fat_size_in_bytes, volume->fat_table, volume->fat_table_entries_count);
+
+    return 0;
+}
+
+int read_file_allocation_table_section(Fat12Volume *volume) {
+    uint64_t started = stats_clock(volume);
+    int status = unpack_file_allocation_table_section(volume);
+    stats_add_phase(volume, PHASE_FAT, started);
+    return status;
 }
 
 // Forward declaration
-void read_data_in_this_entry(StandardDirectoryEntry *entry);
+void read_data_in_this_entry(Fat12Volume *volume, const StandardDirectoryEntry *entry);
 
 int too_many_prints = 0;
-void print_standard_directory_entry(StandardDirectoryEntry *entry) {
+void print_standard_directory_entry(Fat12Volume *volume, const StandardDirectoryEntry *entry) {
     // if(too_many_prints > 5) return;
 
-    print_string    ("FILE NAME                         ", (unsigned char *) &entry->file_name                   , 11);
-    print_hex       ("ATTRIBUTE                         ", (uint8_t *) &entry->attribute                         ,  1);
-    print_hex       ("RESERVED WINDOWS NT               ", (uint8_t *) &entry->reserved_windows_nt               ,  1);
-    print_hex       ("CREATION TIME IN HUNDREDTH SECS   ", (uint8_t *) &entry->creation_time_in_hundredth_secs   ,  1);
-    print_hex       ("CREATED TIME                      ", (uint8_t *) &entry->created_time                      ,  2);
-    print_hex       ("CREATED DATE                      ", (uint8_t *) &entry->created_date                      ,  2);
-    print_hex       ("LAST ACCESSED DATE                ", (uint8_t *) &entry->last_accessed_date                ,  2);
-    print_hex       ("ALWAYS ZERO                       ", (uint8_t *) &entry->always_zero                       ,  2);
-    print_hex       ("LAST MODIFIED TIME                ", (uint8_t *) &entry->last_modified_time                ,  2);
-    print_hex       ("LAST MODIFIED DATE                ", (uint8_t *) &entry->last_modified_date                ,  2);
-    print_decimal   ("FIRST CLUSTER NUMBER              ", entry->first_cluster_number                               );
-    print_decimal   ("FILE SIZE IN BYTES                ", entry->file_size_in_bytes                                 );
-    printf("\n");
+    print_string    (volume, "FILE NAME                         ", (const unsigned char *) &entry->file_name                   , 11);
+    print_hex       (volume, "ATTRIBUTE                         ", (const uint8_t *) &entry->attribute                         ,  1);
+    print_hex       (volume, "RESERVED WINDOWS NT               ", (const uint8_t *) &entry->reserved_windows_nt               ,  1);
+    print_hex       (volume, "CREATION TIME IN HUNDREDTH SECS   ", (const uint8_t *) &entry->creation_time_in_hundredth_secs   ,  1);
+    print_hex       (volume, "CREATED TIME                      ", (const uint8_t *) &entry->created_time                      ,  2);
+    print_hex       (volume, "CREATED DATE                      ", (const uint8_t *) &entry->created_date                      ,  2);
+    print_hex       (volume, "LAST ACCESSED DATE                ", (const uint8_t *) &entry->last_accessed_date                ,  2);
+    print_hex       (volume, "ALWAYS ZERO                       ", (const uint8_t *) &entry->always_zero                       ,  2);
+    print_hex       (volume, "LAST MODIFIED TIME                ", (const uint8_t *) &entry->last_modified_time                ,  2);
+    print_hex       (volume, "LAST MODIFIED DATE                ", (const uint8_t *) &entry->last_modified_date                ,  2);
+    print_decimal   (volume, "FIRST CLUSTER NUMBER              ", entry->first_cluster_number                               );
+    print_decimal   (volume, "FILE SIZE IN BYTES                ", entry->file_size_in_bytes                                 );
+    out_printf(volume->out, "\n");
     too_many_prints++;
 }
 
-uint16_t get_next_cluster_number(int active_cluster_number) {
-    // 12-bit entry isn't Byte aligned / Word aligned.
-    // Suppose last entry of sector is 0x123, and first entry of next sector is 0x456
-    // So the last byte of sector beecomes 0x23, and first 2 bytes of next sector becomes 0x61 0x45
-    // So read 2 sectors every-time to be safe.
+uint16_t get_next_cluster_number(Fat12Volume *volume, int active_cluster_number) {
+    // 12-bit entries were already unpacked in read_file_allocation_table_section().
+    // Anything pointing outside the FAT is treated like a bad cluster, so the chain stops there.
+    if(active_cluster_number < 0 || active_cluster_number >= volume->fat_table_entries_count) {
+        return 0xFF7;
+    }
+
+    return volume->fat_table[active_cluster_number];
+}
+
+int is_chain_link(uint16_t table_value) {
+    // 0, 1 are reserved, 0xFF7 is a bad cluster, 0xFF8 - 0xFFF is end of chain.
+    return table_value >= 2 && table_value < 0xFF7;
+}
+
+void append_cluster_to_chain(ClusterChain *chain, int cluster_number) {
+    if(chain->extents_count > 0) {
+        ClusterExtent *last = &chain->extents[chain->extents_count - 1];
+        if(last->first_cluster_number + last->cluster_count == cluster_number) {
+            last->cluster_count++;
+            chain->clusters_count++;
+            return;
+        }
+    }
 
-    // TODO: Logic could be added to determine if the entry is the last one in the sector.
-    //      But is the overhead worth it?
+    if(chain->extents_count == chain->extents_capacity) {
+        chain->extents_capacity = chain->extents_capacity > 0 ? 2 * chain->extents_capacity : 4;
+        chain->extents = (ClusterExtent *) realloc(chain->extents, sizeof(ClusterExtent) * chain->extents_capacity);
+    }
 
-    uint8_t fat_table_sector[2 * boot_record.bytes_per_sector];
-    uint16_t table_value;
+    chain->extents[chain->extents_count++] = (ClusterExtent) { cluster_number, 1 };
+    chain->clusters_count++;
+}
 
-    int fat12_table_index = active_cluster_number + (active_cluster_number / 2);
-    // printf("FAT12 Table Index: %d \n", fat12_table_index);
+void resolve_cluster_chain(Fat12Volume *volume, int first_cluster_number, ClusterChain *chain) {
+    // Walk the chain once, up front, and squash it into extents.
+    // This is a loop instead of recursion, so a long chain can't blow the stack.
+    // A chain can't be longer than the FAT, so anything longer must be a loop in the FAT.
+    *chain = (ClusterChain) { 0 };
 
-    // Instead of reading the entire FAT table, just the sector containing data can be read.
-    int fat_sector = fat12_table_index / boot_record.bytes_per_sector;
-    int sector_offset = fat12_table_index % boot_record.bytes_per_sector;
+    if(!is_chain_link(first_cluster_number)) {
+        chain->last_table_value = first_cluster_number;
+        return;
+    }
 
-    fseek(image_file, file_desc_fat_section_offset + fat_sector * boot_record.bytes_per_sector, SEEK_SET);
-    fread(&fat_table_sector, 2 * boot_record.bytes_per_sector, 1, image_file);
+    uint64_t started = stats_clock(volume);
+    int active_cluster_number = first_cluster_number;
+    while(1) {
+        if(chain->clusters_count >= volume->fat_table_entries_count) {
+            chain->is_looped = 1;
+            break;
+        }
+        append_cluster_to_chain(chain, active_cluster_number);
 
-    table_value = *((uint16_t *)(&fat_table_sector[sector_offset]));
+        uint16_t next_cluster_number = get_next_cluster_number(volume, active_cluster_number);
+        if(!is_chain_link(next_cluster_number)) {
+            chain->last_table_value = next_cluster_number;
+            break;
+        }
+        active_cluster_number = next_cluster_number;
+    }
 
-    if(active_cluster_number % 2 == 1) {
-        table_value >>= 4;
-    } else {
-        table_value &= 0xFFF;
+    if(volume->stats != NULL) {
+        STATS_ADD(volume, chains_resolved, 1);
+        STATS_ADD(volume, clusters_followed, chain->clusters_count);
+        stats_add_phase(volume, PHASE_CHAIN_WALK, started);
     }
+}
+
+void free_cluster_chain(ClusterChain *chain) {
+    free(chain->extents);
+    *chain = (ClusterChain) { 0 };
+}
 
-    // printf("First Byte   : %02X \n", fat_table[fat12_table_index]);
-    // printf("Second Byte  : %02X \n", fat_table[fat12_table_index + 1]);
+void prefetch_image_bytes(Fat12Volume *volume, size_t offset, size_t length) {
+    // One readahead hint per extent, instead of faulting the pages in one sector at a time.
+    if(!volume->image.is_mapped || length == 0) return;
 
-    return table_value;
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t aligned_offset = offset - (offset % page_size);
+    madvise((void *) (volume->image.data + aligned_offset), length + (offset - aligned_offset), MADV_WILLNEED);
+    STATS_ADD(volume, advise_calls, 1);
 }
 
-void read_n_directory_entries(RootDirectoryEntry *entries, int n) {
-    const int buffer_size = 20 * bytes_per_lfn_entry;
-    unsigned char temporary_buffer[buffer_size];
-    int long_file_name_size = 0;
+// LFN assembly. A run of LFN entries only names the 8.3 entry right after it if:
+// - the first one has the 0x40 "last" flag, with an ordinal N from 1 to 20,
+// - the rest count down N - 1, ..., 1, in slots right next to each other,
+// - they all carry the checksum of that 8.3 name.
+// Anything else is an orphan (the 8.3 entry was rewritten by something that doesn't know LFNs),
+// or a stale run from a deleted file, and the 8.3 entry just keeps its short name.
+typedef struct {
+    uint16_t units[MAX_LFN_ENTRIES * 13];
+    int entries_count;    // LFN entries in the current run.
+    int expected_ordinal; // The ordinal the next entry should have. 0 when the run is complete.
+    int last_index;       // Slot of the last entry, to make sure the run has no gaps.
+    uint8_t checksum;
+    int is_valid;
+} LfnAssembler;
 
-    int unused_entries = 0;
-    int empty_entries = 0;
-    int lfn_entries = 0;
-    int standard_entries = 0;
+uint8_t short_name_checksum(const uint8_t *short_name) {
+    // Every LFN entry stores this, so a reader can tell the LFN entries still belong to the 8.3 entry.
+    uint8_t checksum = 0;
+    for(int i = 0; i < 11; i++) {
+        checksum = ((checksum & 1) << 7) + (checksum >> 1) + short_name[i];
+    }
+    return checksum;
+}
 
-    for(int i=0; i < n; i++) {
-        // Step 1:
-        // First byte tells if directory is empty / unused / has data.
-        // LFN Entries Seq Number just happens to be exactly the byte we need to check.
-        if(entries[i].standard_entry.file_name[0] == 0x00 || entries[i].lfn_entry.sequence_number == 0x00) {
-            empty_entries++;
-            continue;
+void lfn_reset(LfnAssembler *lfn) {
+    lfn->entries_count = 0;
+    lfn->expected_ordinal = 0;
+    lfn->last_index = -2;
+    lfn->is_valid = 0;
+}
+
+void lfn_add_entry(LfnAssembler *lfn, int index, const LongFileNameEntry *lfn_entry) {
+    // For some reason, the last entry has extra 64? Like: 1, 2, 3, 4, 5 + 64. Why???
+    // 64 or 0x40 corresponds to the bit-7 of the sequence number.
+    // This bit is used as a flag to indicate the last long file name entry.
+    // The last entry is stored first, so it's the one that starts a run.
+    int sequence_number = lfn_entry->sequence_number & ~0x40; // Set the bit-7 to 0.
+    int is_first = lfn_entry->sequence_number & 0x40;
+
+    if(is_first) {
+        lfn_reset(lfn);
+        lfn->is_valid = sequence_number >= 1 && sequence_number <= MAX_LFN_ENTRIES;
+        lfn->expected_ordinal = sequence_number;
+        lfn->checksum = lfn_entry->checksum;
+    } else if(lfn->last_index != index - 1 || sequence_number != lfn->expected_ordinal || lfn_entry->checksum != lfn->checksum) {
+        lfn->is_valid = 0;
+    }
+    lfn->entries_count++;
+    lfn->last_index = index;
+    if(!lfn->is_valid) return;
+
+    // The entries point into the read-only image mapping, so the name parts are copied out.
+    // Each entry holds 13 UTF-16 units, split 5 / 6 / 2 over the three name fields.
+    uint8_t fragment[26];
+    memcpy(fragment, lfn_entry->name_1, bytes_name_1);
+    memcpy(fragment + bytes_name_1, lfn_entry->name_2, bytes_name_2);
+    memcpy(fragment + bytes_name_1 + bytes_name_2, lfn_entry->name_3, bytes_name_3);
+
+    uint16_t *units = lfn->units + (sequence_number - 1) * 13;
+    for(int i = 0; i < 13; i++) {
+        units[i] = fragment[2 * i] | (fragment[2 * i + 1] << 8);
+    }
+    lfn->expected_ordinal--;
+}
+
+int utf16_to_utf8(const uint16_t *units, int units_count, char *name, int name_size) {
+    // Stops at 0x0000 (0xFFFF is only ever padding after it). Unpaired surrogates become U+FFFD.
+    // Returns the length, without the '\0'.
+    int length = 0;
+    int i = 0;
+    while(i < units_count) {
+#ifdef __SSE2__
+        // Most names are plain ASCII. Eight units at a time: if none is 0 or above 0x7F,
+        // they just get narrowed to bytes.
+        if(i + 8 <= units_count && length + 8 < name_size) {
+            __m128i block = _mm_loadu_si128((const __m128i *) (units + i));
+            __m128i zero = _mm_setzero_si128();
+            __m128i non_ascii = _mm_and_si128(block, _mm_set1_epi16((short) 0xFF80));
+            int ascii_mask = _mm_movemask_epi8(_mm_cmpeq_epi16(non_ascii, zero));
+            int end_mask = _mm_movemask_epi8(_mm_cmpeq_epi16(block, zero));
+            if(ascii_mask == 0xFFFF && end_mask == 0) {
+                _mm_storel_epi64((__m128i *) (name + length), _mm_packus_epi16(block, block));
+                length += 8;
+                i += 8;
+                continue;
+            }
         }
+#endif
+        uint32_t code_point = units[i++];
+        if(code_point == 0x0000 || code_point == 0xFFFF) break;
 
-        // Step 2:
-        // Check if the entry is unused.
-        if(entries[i].standard_entry.file_name[0] == 0xE5 || entries[i].lfn_entry.sequence_number == 0xE5) {
-            unused_entries++;
-            continue;
+        if(code_point >= 0xD800 && code_point <= 0xDBFF && i < units_count && units[i] >= 0xDC00 && units[i] <= 0xDFFF) {
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (units[i++] - 0xDC00);
+        } else if(code_point >= 0xD800 && code_point <= 0xDFFF) {
+            code_point = 0xFFFD;
+        }
+
+        int bytes_count = code_point < 0x80 ? 1 : code_point < 0x800 ? 2 : code_point < 0x10000 ? 3 : 4;
+        if(length + bytes_count >= name_size) break;
+        if(bytes_count == 1) {
+            name[length++] = (char) code_point;
+        } else if(bytes_count == 2) {
+            name[length++] = (char) (0xC0 | (code_point >> 6));
+            name[length++] = (char) (0x80 | (code_point & 0x3F));
+        } else if(bytes_count == 3) {
+            name[length++] = (char) (0xE0 | (code_point >> 12));
+            name[length++] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+            name[length++] = (char) (0x80 | (code_point & 0x3F));
+        } else {
+            name[length++] = (char) (0xF0 | (code_point >> 18));
+            name[length++] = (char) (0x80 | ((code_point >> 12) & 0x3F));
+            name[length++] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+            name[length++] = (char) (0x80 | (code_point & 0x3F));
+        }
+    }
+    name[length] = '\0';
+    return length;
+}
+
+int lfn_finish(LfnAssembler *lfn, int index, const StandardDirectoryEntry *entry, char *name, int name_size) {
+    // Called with the 8.3 entry in slot index. If the run in front of it is a valid name for it,
+    // writes the name as UTF-8 and returns how many LFN entries it took. Otherwise returns 0.
+    // Either way the run is used up.
+    int entries_count = lfn->entries_count;
+    int is_name = lfn->is_valid && entries_count > 0 && lfn->expected_ordinal == 0 && lfn->last_index == index - 1 &&
+                  lfn->checksum == short_name_checksum(entry->file_name);
+    lfn_reset(lfn);
+
+    if(!is_name) return 0;
+    utf16_to_utf8(lfn->units, entries_count * 13, name, name_size);
+    return name[0] != '\0' ? entries_count : 0;
+}
+
+// Directory slots are classified 16 at a time, as one bit per slot.
+typedef struct {
+    uint16_t free_mask;     // First byte 0x00. The first one is the end of the directory.
+    uint16_t deleted_mask;  // First byte 0xE5.
+    uint16_t lfn_mask;      // Attribute 0x0F.
+    uint16_t dot_mask;      // "." and "..".
+    uint16_t live_mask;     // Every other file / directory / volume label.
+} DirectorySlotMasks;
+
+typedef struct {
+    int free_count;
+    int deleted_count;
+    int lfn_count;
+    int standard_count;
+} DirectorySlotCounts;
+
+void classify_directory_slots(const RootDirectoryEntry *entries, int count, DirectorySlotMasks *masks) {
+    // Only 2 bytes of each 32-byte slot matter: the first byte of the name, and the attribute.
+    // Pull those out for 16 slots, then compare all 16 at once.
+    uint8_t first_bytes[16] = { 0 };
+    uint8_t attributes[16] = { 0 };
+    for(int i = 0; i < count; i++) {
+        first_bytes[i] = entries[i].standard_entry.file_name[0];
+        attributes[i] = entries[i].standard_entry.attribute;
+    }
+    uint16_t valid_mask = count >= 16 ? 0xFFFF : (uint16_t) ((1u << count) - 1);
+
+#ifdef __SSE2__
+    __m128i first = _mm_loadu_si128((const __m128i *) first_bytes);
+    __m128i attribute = _mm_loadu_si128((const __m128i *) attributes);
+
+    uint16_t free_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(first, _mm_setzero_si128()));
+    uint16_t deleted_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(first, _mm_set1_epi8((char) 0xE5)));
+    uint16_t lfn_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(attribute, _mm_set1_epi8(0x0F)));
+    uint16_t dot_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(first, _mm_set1_epi8('.')));
+#else
+    uint16_t free_mask = 0, deleted_mask = 0, lfn_mask = 0, dot_mask = 0;
+    for(int i = 0; i < 16; i++) {
+        free_mask |= (first_bytes[i] == 0x00) << i;
+        deleted_mask |= (first_bytes[i] == 0xE5) << i;
+        lfn_mask |= (attributes[i] == 0x0F) << i;
+        dot_mask |= (first_bytes[i] == '.') << i;
+    }
+#endif
+
+    // Each slot lands in exactly one mask. Free / deleted win over the attribute byte.
+    masks->free_mask = free_mask & valid_mask;
+    masks->deleted_mask = deleted_mask & valid_mask & ~free_mask;
+    masks->lfn_mask = lfn_mask & valid_mask & ~(free_mask | deleted_mask);
+    masks->dot_mask = dot_mask & valid_mask & ~(free_mask | deleted_mask | lfn_mask);
+    masks->live_mask = valid_mask & ~(free_mask | deleted_mask | lfn_mask | dot_mask);
+}
+
+int scan_directory_slots(const RootDirectoryEntry *entries, int n, int full_slot_audit,
+                         int *slot_indices, DirectorySlotCounts *counts, int *reached_end) {
+    // Writes the index of every LFN / standard entry into slot_indices, in order, and returns how many.
+    // Stops at the first 0x00 slot, since nothing after it is in use,
+    // unless full_slot_audit asks for every slot to be looked at and counted.
+    int indices_count = 0;
+    *reached_end = 0;
+
+    for(int block_start = 0; block_start < n; block_start += 16) {
+        int count = n - block_start < 16 ? n - block_start : 16;
+
+        DirectorySlotMasks masks;
+        classify_directory_slots(entries + block_start, count, &masks);
+
+        if(!full_slot_audit && masks.free_mask != 0) {
+            uint16_t before_end = (uint16_t) ((1u << __builtin_ctz(masks.free_mask)) - 1);
+            masks.free_mask = 1u << __builtin_ctz(masks.free_mask);
+            masks.deleted_mask &= before_end;
+            masks.lfn_mask &= before_end;
+            masks.dot_mask &= before_end;
+            masks.live_mask &= before_end;
+            *reached_end = 1;
+        }
+
+        if(counts != NULL) {
+            counts->free_count += __builtin_popcount(masks.free_mask);
+            counts->deleted_count += __builtin_popcount(masks.deleted_mask);
+            counts->lfn_count += __builtin_popcount(masks.lfn_mask);
+            counts->standard_count += __builtin_popcount(masks.dot_mask | masks.live_mask);
         }
 
+        uint16_t pending = masks.lfn_mask | masks.dot_mask | masks.live_mask;
+        while(pending != 0) {
+            slot_indices[indices_count++] = block_start + __builtin_ctz(pending);
+            pending &= pending - 1;
+        }
+
+        if(*reached_end) break;
+    }
+
+    return indices_count;
+}
+
+int scan_volume_directory_slots(Fat12Volume *volume, const RootDirectoryEntry *entries, int n,
+                                int *slot_indices, DirectorySlotCounts *counts, int *reached_end) {
+    // scan_directory_slots(), timed for --stats. The root directory is told apart by where it lives in the image.
+    uint64_t started = stats_clock(volume);
+    int indices_count = scan_directory_slots(entries, n, volume->full_slot_audit, slot_indices, counts, reached_end);
+
+    if(volume->stats != NULL) {
+        const uint8_t *position = (const uint8_t *) entries;
+        int is_root = position >= volume->image.data + volume->file_desc_root_directory_offset &&
+                      position < volume->image.data + volume->file_desc_data_section_offset;
+        stats_add_phase(volume, is_root ? PHASE_ROOT_DIRECTORY : PHASE_SUBDIRECTORIES, started);
+    }
+    return indices_count;
+}
+
+void read_n_directory_entries(Fat12Volume *volume, const RootDirectoryEntry *entries, int n) {
+    LfnAssembler lfn;
+    char long_file_name[MAX_NAME_UTF8_LENGTH + 1];
+    lfn_reset(&lfn);
+
+    // Step 1 and 2:
+    // Empty / unused slots are dropped by the scanner, 16 at a time.
+    // It stops at the first empty slot, which marks the end of the directory.
+    DirectorySlotCounts counts = { 0 };
+    int reached_end;
+    int *slot_indices = (int *) malloc(sizeof(int) * (n > 0 ? n : 1));
+    int slots_count = scan_volume_directory_slots(volume, entries, n, slot_indices, &counts, &reached_end);
+
+    for(int slot = 0; slot < slots_count; slot++) {
+        int i = slot_indices[slot];
+
         // Step 3:
         // Check if the entry is a Long File Name entry.
         if(entries[i].standard_entry.attribute == 0x0F || entries[i].lfn_entry.attribute == 0x0F) {
-            lfn_entries++;
-
             // Step 4:
-            // Read the portion of long file name into temporary buffer
-
-            // For some reason, the last entry has extra 64? Like: 1, 2, 3, 4, 5 + 64. Why???
-            // 64 or 0x40 corresponds to the bit-7 of the sequence number.
-            // This bit is used as a flag to indicate the last long file name entry.
-            int is_last_lfn_entry = (0x40 & entries[i].lfn_entry.sequence_number) > 0;
-            
-            // Remove the flag for last entry from the sequence number
-            // It keeps the sequence number based calculations simpler.
-            if(is_last_lfn_entry) {
-                entries[i].lfn_entry.sequence_number ^= 0x40; // Set the bit-7 to 0.
-            }
+            // Collect the portion of long file name. lfn_add_entry() checks the ordinals and checksums.
 
             // printf("Sequence Number: %d\n", entries[i].lfn_entry.sequence_number);
 
@@ -352,37 +1031,7 @@ void read_n_directory_entries(RootDirectoryEntry *entries, int n) {
             // print_string("NAME 2", entries[i].lfn_entry.name_2, 12);
             // print_string("NAME 3", entries[i].lfn_entry.name_3, 4);
 
-            long_file_name_size += bytes_per_lfn_entry;
-
-            memcpy(
-                    (
-                        temporary_buffer + 
-                        (entries[i].lfn_entry.sequence_number - 1) * bytes_per_lfn_entry
-                    ),
-                    entries[i].lfn_entry.name_1, 
-                    bytes_name_1
-                );
-
-            memcpy(
-                    (
-                        temporary_buffer + 
-                        (entries[i].lfn_entry.sequence_number - 1) * bytes_per_lfn_entry + 
-                        bytes_name_1                        
-                    ),
-                    entries[i].lfn_entry.name_2, 
-                    bytes_name_2
-                );
-                    
-            memcpy(
-                    (
-                        temporary_buffer + 
-                        (entries[i].lfn_entry.sequence_number - 1) * bytes_per_lfn_entry + 
-                        bytes_name_1 + 
-                        bytes_name_2
-                    ), 
-                    entries[i].lfn_entry.name_3, 
-                    bytes_name_3
-                );
+            lfn_add_entry(&lfn, i, &entries[i].lfn_entry);
 
             continue;
         } else{
@@ -391,18 +1040,16 @@ void read_n_directory_entries(RootDirectoryEntry *entries, int n) {
             // If it is, then that's then name associated with the the current standard entry.
 
             // Established through brute force that max number of entries used will be 20 for LFN.
-            if(long_file_name_size > 0) {
-                print_long_file_name("LONG FILE NAME    ", temporary_buffer, long_file_name_size);
-                // printf("Number of entries used: %d\n", long_file_name_size / bytes_per_lfn_entry);
-                long_file_name_size = 0;
+            // Only if the checksum matches this entry though. Otherwise it belonged to some other file.
+            if(lfn_finish(&lfn, i, &entries[i].standard_entry, long_file_name, sizeof(long_file_name)) > 0) {
+                print_long_file_name(volume, "LONG FILE NAME    ", long_file_name);
             }
-            standard_entries++;
         }
 
         // Step 6:
         // Print the standard entry data.
-        printf("Entry %d:\n", i);
-        print_standard_directory_entry(&entries[i].standard_entry);
+        out_printf(volume->out, "Entry %d:\n", i);
+        print_standard_directory_entry(volume, &entries[i].standard_entry);
 
         // Step 7:
         // Read the data in this entry if the attribute is ARCHIEVE / DIRECTORY.
@@ -414,55 +1061,65 @@ void read_n_directory_entries(RootDirectoryEntry *entries, int n) {
             // Even though it's less than 8.3 Format length
             if(entries[i].standard_entry.file_name[0] == '.') continue;
 
-            read_data_in_this_entry(&entries[i].standard_entry);
-            printf("\n");
+            read_data_in_this_entry(volume, &entries[i].standard_entry);
+            out_printf(volume->out, "\n");
         }
     }
+    free(slot_indices);
 
-    printf("Total entries       : %d\n", unused_entries + empty_entries + lfn_entries + standard_entries);
-    printf("Unused entries      : %d\n", unused_entries);
-    printf("Empty entries       : %d\n", empty_entries);
-    printf("LFN entries         : %d\n", lfn_entries);
-    printf("Standard entries    : %d\n", standard_entries);
-    printf("\n");    
+    // The counters only cover every slot when the scan didn't stop early.
+    if(volume->full_slot_audit) {
+        out_printf(volume->out, "Total entries       : %d\n", counts.deleted_count + counts.free_count + counts.lfn_count + counts.standard_count);
+        out_printf(volume->out, "Unused entries      : %d\n", counts.deleted_count);
+        out_printf(volume->out, "Empty entries       : %d\n", counts.free_count);
+        out_printf(volume->out, "LFN entries         : %d\n", counts.lfn_count);
+        out_printf(volume->out, "Standard entries    : %d\n", counts.standard_count);
+        out_printf(volume->out, "\n");
+    }
 }
 
-void read_cluster_chain(int active_cluster_number, int is_directory) {
-    uint8_t cluster_data [512]; // Not sure how to use the dynamic value from: boot_record.bytes_per_sector
+void read_cluster_chain(Fat12Volume *volume, int first_cluster_number, int is_directory) {
+    // The directory entry indicates ARCHIEVE / DIRECTORY
+    // It also points to the first cluster number
+    // So all the entire cluster chain contains either ARCHIEVE data / DIRECTORY data
+    // It won't change mid chain
+    ClusterChain chain;
+    resolve_cluster_chain(volume, first_cluster_number, &chain);
 
-    // Move the file pointer to the cluster location
-    fseek(image_file, 
-            file_desc_data_section_offset + ((active_cluster_number - 2) * boot_record.bytes_per_sector),
-            SEEK_SET
-        );
-    fread(&cluster_data, 512, 1, image_file);
+    for(int i = 0; i < chain.extents_count; i++) {
+        const ClusterExtent *extent = &chain.extents[i];
+        size_t extent_offset = volume->file_desc_data_section_offset + ((size_t) (extent->first_cluster_number - 2) * volume->bytes_per_cluster);
+        size_t extent_size = (size_t) extent->cluster_count * volume->bytes_per_cluster;
 
-    if(is_directory) {
-        // 512 bytes / 32 bytes per entry = 16 entries
-        RootDirectoryEntry *entries = (RootDirectoryEntry *) cluster_data;
-        read_n_directory_entries(entries, 16);
-    } else {
-        print_plain_string(cluster_data, 512);
-    }
+        // Point at the whole extent inside the image mapping. No copy into a local buffer.
+        const uint8_t *extent_data = image_bytes(volume, extent_offset, extent_size);
+        if(extent_data == NULL) {
+            out_printf(volume->out, "\nCluster %d is outside the image.\n", extent->first_cluster_number);
+            free_cluster_chain(&chain);
+            return;
+        }
+        prefetch_image_bytes(volume, extent_offset, extent_size);
 
-    uint16_t next_cluster_number = get_next_cluster_number(active_cluster_number);
+        if(is_directory) {
+            // bytes_per_cluster / 32 bytes per entry. 16 entries for a 512 byte cluster.
+            const RootDirectoryEntry *entries = (const RootDirectoryEntry *) extent_data;
+            read_n_directory_entries(volume, entries, volume->directory_entries_per_cluster * extent->cluster_count);
+        } else {
+            print_plain_string(volume, extent_data, extent_size);
+        }
+    }
 
-    if(next_cluster_number >= 0xFF8) {
-        printf("\nThere are no more clusters in the chain.\n");
-    } else if(next_cluster_number == 0xFF7) {
-        printf("\nThis is a bad cluster.\n");
-    } else if(next_cluster_number == 0 || next_cluster_number == 1) {
-        printf("\nThese are reserved for their own purposes.\n");
+    if(chain.is_looped) {
+        out_printf(volume->out, "\nThe cluster chain loops back on itself.\n");
+    } else if(chain.last_table_value >= 0xFF8) {
+        out_printf(volume->out, "\nThere are no more clusters in the chain.\n");
+    } else if(chain.last_table_value == 0xFF7) {
+        out_printf(volume->out, "\nThis is a bad cluster.\n");
     } else {
-        // printf("Next cluster number: %d\n\n", next_cluster_number);
-
-        // The directory entry indicates ARCHIEVE / DIRECTORY
-        // It also points to the first cluster number
-        // So all the entire cluster chain contains either ARCHIEVE data / DIRECTORY data
-        // It won't change mid chain
-        // TODO: But I'm not able to make it work properly
-        read_cluster_chain(next_cluster_number, is_directory);
+        out_printf(volume->out, "\nThese are reserved for their own purposes.\n");
     }
+
+    free_cluster_chain(&chain);
 }
 
 // According the FAT12 OSDev Wiki Page, FAT considered storage as a series of clusters.
@@ -470,21 +1127,21 @@ void read_cluster_chain(int active_cluster_number, int is_directory) {
 // If the data can't fit in a single cluster, then it points to another cluster in the Data Section.
 // Sort of like a linked list.
 
-void read_data_in_this_entry(StandardDirectoryEntry *entry) {
+void read_data_in_this_entry(Fat12Volume *volume, const StandardDirectoryEntry *entry) {
     if(entry->attribute == 0x20) {
-        printf("ATTRIBUTE: ARCHIEVE\n");
-        read_cluster_chain(entry->first_cluster_number, 0);
-        printf("END OF ARCHIEVE CHAIN\n");
+        out_printf(volume->out, "ATTRIBUTE: ARCHIEVE\n");
+        read_cluster_chain(volume, entry->first_cluster_number, 0);
+        out_printf(volume->out, "END OF ARCHIEVE CHAIN\n");
     }
 
     if(entry->attribute == 0x10) {
-        printf("ATTRIBUTE: DIRECTORY\n");
-        read_cluster_chain(entry->first_cluster_number, 1);
-        printf("END OF DIRECTORY CHAIN\n");
+        out_printf(volume->out, "ATTRIBUTE: DIRECTORY\n");
+        read_cluster_chain(volume, entry->first_cluster_number, 1);
+        out_printf(volume->out, "END OF DIRECTORY CHAIN\n");
     }
 }
 
-void read_root_directory_section() {
+int read_root_directory_section(Fat12Volume *volume) {
 
     // Original I thought it could have 223 LFN entries + 1 Standard Entry that the LFN corresponds to.
     // But the sequence number uses bit-7 as a flag to indiciate last entry in the LFN chain.
@@ -498,31 +1155,4326 @@ void read_root_directory_section() {
 
     // This number is much lower at 20. Calculated through brute force.
 
-    RootDirectoryEntry *entries = (RootDirectoryEntry *) malloc(sizeof(RootDirectoryEntry) * boot_record.root_dir_entries_count);
-    fread(entries, sizeof(RootDirectoryEntry), boot_record.root_dir_entries_count, image_file);
+    // The Root Directory sits right after the FAT Section.
+    const RootDirectoryEntry *entries = (const RootDirectoryEntry *) image_bytes(volume,
+            volume->file_desc_root_directory_offset,
+            sizeof(RootDirectoryEntry) * volume->boot_record->root_dir_entries_count
+        );
+    if(entries == NULL) {
+        fprintf(stderr, "Error: %s: Image is too small to contain the Root Directory\n", volume->image_path);
+        return -1;
+    }
+
+    read_n_directory_entries(volume, entries, volume->boot_record->root_dir_entries_count);
+    return 0;
+}
+
+// Everything below is for looking up a single path, instead of dumping the whole volume.
+// A path is resolved one component at a time, and only the directories on that path are read.
+
+// One live entry of a directory, with the Long File Name (if any) already put together.
+typedef struct {
+    const StandardDirectoryEntry *entry;
+    char long_name[MAX_NAME_UTF8_LENGTH + 1]; // UTF-8
+    char short_name[13]; // "LORE1024.TXT" + '\0'
+    int lfn_entries_count; // LFN slots right in front of entry. Needed to delete it.
+} DirectoryItem;
+
+// Walks the entries of one directory. The Root Directory is a flat array,
+// every other directory is a cluster chain, which is walked one extent at a time.
+typedef struct {
+    Fat12Volume *volume;
+
+    ClusterChain chain;
+    int extent_index;
 
-    read_n_directory_entries(entries, boot_record.root_dir_entries_count);
+    // The current run of entries, and the slots in it that the scanner says are in use.
+    const RootDirectoryEntry *entries;
+    int *slot_indices;
+    int slot_indices_capacity;
+    int slots_count;
+    int slot_position;
+    int reached_end;
+
+    LfnAssembler lfn;
+} DirectoryIterator;
+
+void decode_short_file_name(const StandardDirectoryEntry *entry, char *name) {
+    // "LORE1024TXT" -> "LORE1024.TXT". The name and extension are space padded.
+    int length = 0;
+
+    for(int i = 0; i < 8 && entry->file_name[i] != ' '; i++) {
+        // 0x05 is stored when the real first char is 0xE5, since 0xE5 means deleted.
+        name[length++] = (i == 0 && entry->file_name[0] == 0x05) ? (char) 0xE5 : entry->file_name[i];
+    }
+    if(entry->file_name[8] != ' ') {
+        name[length++] = '.';
+        for(int i = 8; i < 11 && entry->file_name[i] != ' '; i++) {
+            name[length++] = entry->file_name[i];
+        }
+    }
+    name[length] = '\0';
 }
 
-void close_disk_img() {
-    // Forgot that closing a file is a thing
-    if(image_file != NULL) fclose(image_file);
+void apply_short_name_case(const StandardDirectoryEntry *entry, const char *short_name, char *name) {
+    // Windows NT keeps all lower case names as 8.3 names, with a flag in byte 12 instead of LFN entries:
+    // 0x08 means the name is lower case, 0x10 the extension.
+    strcpy(name, short_name);
+    int in_extension = 0;
+    for(char *c = name; *c != '\0'; c++) {
+        if(*c == '.') in_extension = 1;
+        if((entry->reserved_windows_nt & (in_extension ? 0x10 : 0x08)) && 'A' <= *c && *c <= 'Z') *c += 'a' - 'A';
+    }
 }
 
-int main(int argc, unsigned char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <image_file_path>\n", argv[0]);
-        return 1;
+void scan_iterator_entries(DirectoryIterator *iterator, int entries_count) {
+    if(iterator->slot_indices_capacity < entries_count) {
+        iterator->slot_indices_capacity = entries_count;
+        iterator->slot_indices = (int *) realloc(iterator->slot_indices, sizeof(int) * entries_count);
     }
-    
-    unsigned char *image_path = argv[1];
-    printf("\nImage file path: %s\n\n", image_path);
-
-    open_disk_img(image_path);
-    read_boot_drive_section();
-    read_file_allocation_table_section();
-    read_root_directory_section();
-    close_disk_img();
-    
-    return 0;
+
+    iterator->slots_count = scan_volume_directory_slots(iterator->volume, iterator->entries, entries_count,
+            iterator->slot_indices, NULL, &iterator->reached_end);
+    iterator->slot_position = 0;
+
+    // LFN runs don't carry over into the next run of entries.
+    lfn_reset(&iterator->lfn);
+}
+
+void open_root_directory(Fat12Volume *volume, DirectoryIterator *iterator) {
+    memset(iterator, 0, sizeof(DirectoryIterator));
+    iterator->volume = volume;
+
+    iterator->entries = (const RootDirectoryEntry *) image_bytes(volume,
+            volume->file_desc_root_directory_offset,
+            sizeof(RootDirectoryEntry) * volume->boot_record->root_dir_entries_count
+        );
+    if(iterator->entries != NULL) {
+        scan_iterator_entries(iterator, volume->boot_record->root_dir_entries_count);
+    }
+}
+
+void open_directory(Fat12Volume *volume, DirectoryIterator *iterator, int first_cluster_number) {
+    // ".." entries store cluster 0 when the parent is the Root Directory.
+    if(first_cluster_number == 0) {
+        open_root_directory(volume, iterator);
+        return;
+    }
+
+    memset(iterator, 0, sizeof(DirectoryIterator));
+    iterator->volume = volume;
+    resolve_cluster_chain(volume, first_cluster_number, &iterator->chain);
+}
+
+int load_next_directory_extent(DirectoryIterator *iterator) {
+    Fat12Volume *volume = iterator->volume;
+
+    // Nothing past the end of directory marker, not even in the next extent.
+    while(!iterator->reached_end && iterator->extent_index < iterator->chain.extents_count) {
+        const ClusterExtent *extent = &iterator->chain.extents[iterator->extent_index++];
+        size_t extent_offset = volume->file_desc_data_section_offset + ((size_t) (extent->first_cluster_number - 2) * volume->bytes_per_cluster);
+        size_t extent_size = (size_t) extent->cluster_count * volume->bytes_per_cluster;
+
+        iterator->entries = (const RootDirectoryEntry *) image_bytes(volume, extent_offset, extent_size);
+        if(iterator->entries == NULL) return 0;
+
+        scan_iterator_entries(iterator, volume->directory_entries_per_cluster * extent->cluster_count);
+        return 1;
+    }
+    return 0;
+}
+
+int next_directory_item(DirectoryIterator *iterator, DirectoryItem *item) {
+    // Returns 1 and fills item for every live file / directory, 0 at the end of the directory.
+    // LFN entries are collected along the way, and handed out with the standard entry they precede,
+    // as long as they pass the checks in lfn_finish().
+    // Free and deleted slots were already dropped by scan_directory_slots().
+    while(1) {
+        if(iterator->slot_position >= iterator->slots_count) {
+            if(!load_next_directory_extent(iterator)) return 0;
+            continue;
+        }
+
+        int index = iterator->slot_indices[iterator->slot_position++];
+        const RootDirectoryEntry *entry = &iterator->entries[index];
+
+        if(entry->standard_entry.attribute == 0x0F) {
+            lfn_add_entry(&iterator->lfn, index, &entry->lfn_entry);
+            continue;
+        }
+
+        // Volume label isn't a file.
+        if(entry->standard_entry.attribute & 0x08) {
+            lfn_reset(&iterator->lfn);
+            continue;
+        }
+
+        item->entry = &entry->standard_entry;
+        decode_short_file_name(item->entry, item->short_name);
+        item->lfn_entries_count = lfn_finish(&iterator->lfn, index, item->entry, item->long_name, sizeof(item->long_name));
+        if(item->lfn_entries_count == 0) apply_short_name_case(item->entry, item->short_name, item->long_name);
+        return 1;
+    }
+}
+
+void close_directory(DirectoryIterator *iterator) {
+    free_cluster_chain(&iterator->chain);
+    free(iterator->slot_indices);
+    iterator->slot_indices = NULL;
+}
+
+int names_match(const char *name, const char *path_component, int component_length) {
+    // FAT names are case-insensitive.
+    for(int i = 0; i < component_length; i++) {
+        char a = name[i];
+        char b = path_component[i];
+        if(a == '\0') return 0;
+        if('a' <= a && a <= 'z') a -= 'a' - 'A';
+        if('a' <= b && b <= 'z') b -= 'a' - 'A';
+        if(a != b) return 0;
+    }
+    return name[component_length] == '\0';
+}
+
+int lookup_path(Fat12Volume *volume, const char *path, DirectoryItem *found) {
+    // Returns 1 and fills found for a file / directory. Returns 2 for the Root Directory itself,
+    // since it has no directory entry. Returns 0 if any component of the path doesn't exist.
+    int is_root = 1;
+    int directory_cluster = 0;
+
+    const char *component = path;
+    while(1) {
+        while(*component == '/') component++;
+        if(*component == '\0') break;
+
+        int component_length = strcspn(component, "/");
+
+        // Only directories can have children.
+        if(!is_root && !(found->entry->attribute & 0x10)) return 0;
+
+        DirectoryIterator iterator;
+        open_directory(volume, &iterator, directory_cluster);
+
+        int is_found = 0;
+        while(next_directory_item(&iterator, found)) {
+            if(names_match(found->long_name, component, component_length) ||
+               names_match(found->short_name, component, component_length)) {
+                is_found = 1;
+                break;
+            }
+        }
+        close_directory(&iterator);
+
+        if(!is_found) return 0;
+
+        is_root = 0;
+        directory_cluster = found->entry->first_cluster_number;
+
+        // ".." of a top-level directory points at cluster 0, the Root Directory.
+        if((found->entry->attribute & 0x10) && directory_cluster == 0) {
+            is_root = 1;
+        }
+        component += component_length;
+    }
+
+    return is_root ? 2 : 1;
+}
+
+void format_fat_date_time(uint16_t date, uint16_t time, char *buffer, int buffer_size) {
+    // Date: 7 bits year since 1980, 4 bits month, 5 bits day.
+    // Time: 5 bits hour, 6 bits minute, 5 bits seconds / 2.
+    snprintf(buffer, buffer_size, "%04d-%02d-%02d %02d:%02d:%02d",
+            1980 + (date >> 9), (date >> 5) & 0x0F, date & 0x1F,
+            time >> 11, (time >> 5) & 0x3F, (time & 0x1F) * 2);
+}
+
+void format_attribute(uint8_t attribute, char *buffer) {
+    // One letter per flag, like "ls -l". "-" when the flag isn't set.
+    const char *letters = "RHSVDA";
+    for(int i = 0; i < 6; i++) {
+        buffer[i] = (attribute & (1 << i)) ? letters[i] : '-';
+    }
+    buffer[6] = '\0';
+}
+
+// Called once per file / directory in walk_volume_tree(), parents before their children.
+// path is the full path inside the image, like "/myfolder/lore.txt".
+// Returning non-zero for a directory skips everything inside it.
+typedef int (*VisitEntry)(Fat12Volume *volume, const char *path, const DirectoryItem *item, void *context);
+
+int walk_volume_tree(Fat12Volume *volume, VisitEntry visit, void *context) {
+    // Walk the tree with an explicit stack instead of recursion.
+    typedef struct {
+        int first_cluster_number;
+        char path[PATH_MAX];
+    } PendingDirectory;
+
+    int pending_capacity = 16;
+    int pending_count = 1;
+    PendingDirectory *pending = (PendingDirectory *) malloc(sizeof(PendingDirectory) * pending_capacity);
+    pending[0].first_cluster_number = 0;
+    pending[0].path[0] = '\0';
+
+    int directories_count = 0;
+    int status = 0;
+    while(pending_count > 0) {
+        PendingDirectory directory = pending[--pending_count];
+
+        // A directory that loops back on an ancestor would be walked forever.
+        if(++directories_count > volume->clusters_in_data_section + 1) {
+            fprintf(stderr, "Error: Directory tree loops back on itself\n");
+            status = -1;
+            break;
+        }
+
+        DirectoryIterator iterator;
+        DirectoryItem item;
+        open_directory(volume, &iterator, directory.first_cluster_number);
+
+        while(next_directory_item(&iterator, &item)) {
+            if(strcmp(item.long_name, ".") == 0 || strcmp(item.long_name, "..") == 0) continue;
+
+            // A broken image could put '/' in a name, and make it look like a deeper path.
+            for(char *c = item.long_name; *c != '\0'; c++) {
+                if(*c == '/') *c = '_';
+            }
+
+            char path[PATH_MAX];
+            if(snprintf(path, PATH_MAX, "%s/%s", directory.path, item.long_name) >= PATH_MAX) {
+                fprintf(stderr, "Error: Path too long: %s/%s\n", directory.path, item.long_name);
+                status = -1;
+                continue;
+            }
+
+            int skip_children = visit(volume, path, &item, context);
+
+            // A directory pointing at cluster 0 would be the Root Directory again.
+            if(!(item.entry->attribute & 0x10) || skip_children || item.entry->first_cluster_number == 0) continue;
+
+            if(pending_count == pending_capacity) {
+                pending_capacity *= 2;
+                pending = (PendingDirectory *) realloc(pending, sizeof(PendingDirectory) * pending_capacity);
+            }
+            pending[pending_count].first_cluster_number = item.entry->first_cluster_number;
+            memcpy(pending[pending_count].path, path, PATH_MAX);
+            pending_count++;
+        }
+        close_directory(&iterator);
+    }
+
+    free(pending);
+    return status;
+}
+
+// Structured listings, one record per entry, for pipelines that would otherwise scrape the dump.
+typedef enum {
+    FORMAT_DUMP,
+    FORMAT_JSON,
+    FORMAT_CSV,
+    FORMAT_SUMMARY,
+} OutputFormat;
+
+typedef struct {
+    OutputFormat format;
+    int files_count;
+    int directories_count;
+    uint64_t bytes_count;
+    int clusters_count;
+    int free_clusters_count;
+    char volume_label[12];
+} ListingTotals;
+
+void out_json_string(OutputBuffer *out, const char *str) {
+    out_write(out, "\"", 1);
+    for(; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if(c == '"' || c == '\\') {
+            char escaped[2] = { '\\', (char) c };
+            out_write(out, escaped, 2);
+        } else if(c < 0x20) {
+            out_printf(out, "\\u%04x", c);
+        } else {
+            out_write(out, &c, 1);
+        }
+    }
+    out_write(out, "\"", 1);
+}
+
+void out_csv_string(OutputBuffer *out, const char *str) {
+    // Quote everything, and double any quotes inside.
+    out_write(out, "\"", 1);
+    for(; *str != '\0'; str++) {
+        if(*str == '"') out_write(out, "\"", 1);
+        out_write(out, str, 1);
+    }
+    out_write(out, "\"", 1);
+}
+
+void print_entry_record(Fat12Volume *volume, OutputFormat format, const char *path, const DirectoryItem *item) {
+    const StandardDirectoryEntry *entry = item->entry;
+
+    char attribute[7];
+    char created[20];
+    char modified[20];
+    char accessed[20];
+    format_attribute(entry->attribute, attribute);
+    format_fat_date_time(entry->created_date, entry->created_time, created, sizeof(created));
+    format_fat_date_time(entry->last_modified_date, entry->last_modified_time, modified, sizeof(modified));
+    format_fat_date_time(entry->last_accessed_date, 0, accessed, sizeof(accessed));
+    accessed[10] = '\0';
+
+    ClusterChain chain;
+    resolve_cluster_chain(volume, entry->first_cluster_number, &chain);
+    const char *type = (entry->attribute & 0x10) ? "directory" : "file";
+
+    if(format == FORMAT_JSON) {
+        // JSON Lines: one object per line.
+        out_printf(volume->out, "{\"path\":");
+        out_json_string(volume->out, path);
+        out_printf(volume->out, ",\"name\":");
+        out_json_string(volume->out, item->long_name);
+        out_printf(volume->out, ",\"short_name\":");
+        out_json_string(volume->out, item->short_name);
+        out_printf(volume->out,
+                ",\"type\":\"%s\",\"attributes\":\"%s\",\"attribute_byte\":%d,\"size\":%u,"
+                "\"first_cluster\":%d,\"clusters\":%d,\"extents\":%d,"
+                "\"created\":\"%s\",\"modified\":\"%s\",\"accessed\":\"%s\"}\n",
+                type, attribute, entry->attribute, entry->file_size_in_bytes,
+                entry->first_cluster_number, chain.clusters_count, chain.extents_count,
+                created, modified, accessed);
+    } else {
+        out_csv_string(volume->out, path);
+        out_write(volume->out, ",", 1);
+        out_csv_string(volume->out, item->long_name);
+        out_write(volume->out, ",", 1);
+        out_csv_string(volume->out, item->short_name);
+        out_printf(volume->out, ",%s,%s,%d,%u,%d,%d,%d,%s,%s,%s\n",
+                type, attribute, entry->attribute, entry->file_size_in_bytes,
+                entry->first_cluster_number, chain.clusters_count, chain.extents_count,
+                created, modified, accessed);
+    }
+
+    free_cluster_chain(&chain);
+}
+
+void print_records_header(Fat12Volume *volume, OutputFormat format) {
+    if(format == FORMAT_CSV) {
+        out_printf(volume->out, "path,name,short_name,type,attributes,attribute_byte,size,"
+                "first_cluster,clusters,extents,created,modified,accessed\n");
+    }
+}
+
+int list_entry(Fat12Volume *volume, const char *path, const DirectoryItem *item, void *context) {
+    ListingTotals *totals = (ListingTotals *) context;
+
+    if(item->entry->attribute & 0x10) {
+        totals->directories_count++;
+    } else {
+        totals->files_count++;
+        totals->bytes_count += item->entry->file_size_in_bytes;
+    }
+
+    if(totals->format != FORMAT_SUMMARY) {
+        print_entry_record(volume, totals->format, path, item);
+    }
+    return 0;
+}
+
+int collect_volume_totals(Fat12Volume *volume, ListingTotals *totals) {
+    // Walks the tree, and prints a record per entry unless format is FORMAT_SUMMARY.
+    int status = walk_volume_tree(volume, list_entry, totals);
+
+    totals->clusters_count = volume->fat_table_entries_count - 2;
+    for(int i = 2; i < volume->fat_table_entries_count; i++) {
+        if(volume->fat_table[i] == 0) totals->free_clusters_count++;
+    }
+
+    memcpy(totals->volume_label, volume->extended_boot_record->volume_label, 11);
+    totals->volume_label[11] = '\0';
+    return status;
+}
+
+int list_volume(Fat12Volume *volume, OutputFormat format) {
+    ListingTotals totals = { format };
+
+    print_records_header(volume, format);
+    int status = collect_volume_totals(volume, &totals);
+
+    if(format == FORMAT_SUMMARY) {
+        out_printf(volume->out, "Volume Label        : %s\n", totals.volume_label);
+        out_printf(volume->out, "Files               : %d\n", totals.files_count);
+        out_printf(volume->out, "Directories         : %d\n", totals.directories_count);
+        out_printf(volume->out, "Bytes in Files      : %llu\n", (unsigned long long) totals.bytes_count);
+        out_printf(volume->out, "Clusters            : %d\n", totals.clusters_count);
+        out_printf(volume->out, "Free Clusters       : %d\n", totals.free_clusters_count);
+        out_printf(volume->out, "Bytes per Cluster   : %d\n", volume->bytes_per_cluster);
+    }
+    return status != 0;
+}
+
+int stat_path(Fat12Volume *volume, const char *path) {
+    DirectoryItem item;
+    int result = lookup_path(volume, path, &item);
+
+    if(result == 0) {
+        fprintf(stderr, "Error: %s not found\n", path);
+        return 1;
+    }
+    if(result == 2) {
+        out_printf(volume->out, "Path               : /\n");
+        out_printf(volume->out, "Type               : root directory\n");
+        out_printf(volume->out, "Entries            : %d\n", volume->boot_record->root_dir_entries_count);
+        return 0;
+    }
+
+    const StandardDirectoryEntry *entry = item.entry;
+    char attribute[7];
+    char created[20];
+    char modified[20];
+    char accessed[20];
+    format_attribute(entry->attribute, attribute);
+    format_fat_date_time(entry->created_date, entry->created_time, created, sizeof(created));
+    format_fat_date_time(entry->last_modified_date, entry->last_modified_time, modified, sizeof(modified));
+    format_fat_date_time(entry->last_accessed_date, 0, accessed, sizeof(accessed));
+
+    ClusterChain chain;
+    resolve_cluster_chain(volume, entry->first_cluster_number, &chain);
+
+    out_printf(volume->out, "Path               : %s\n", path);
+    out_printf(volume->out, "Long Name          : %s\n", item.long_name);
+    out_printf(volume->out, "Short Name         : %s\n", item.short_name);
+    out_printf(volume->out, "Type               : %s\n", (entry->attribute & 0x10) ? "directory" : "file");
+    out_printf(volume->out, "Attributes         : %s (0x%02X)\n", attribute, entry->attribute);
+    out_printf(volume->out, "Size in Bytes      : %u\n", entry->file_size_in_bytes);
+    out_printf(volume->out, "First Cluster      : %d\n", entry->first_cluster_number);
+    out_printf(volume->out, "Clusters           : %d\n", chain.clusters_count);
+    out_printf(volume->out, "Extents            : %d\n", chain.extents_count);
+    out_printf(volume->out, "Created            : %s\n", created);
+    out_printf(volume->out, "Modified           : %s\n", modified);
+    out_printf(volume->out, "Accessed           : %.10s\n", accessed);
+
+    free_cluster_chain(&chain);
+    return 0;
+}
+
+int write_all(int fd, const uint8_t *data, size_t size) {
+    while(size > 0) {
+        ssize_t bytes_written = write(fd, data, size);
+        if(bytes_written < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        data += bytes_written;
+        size -= bytes_written;
+    }
+    return 0;
+}
+
+uint32_t write_file_data(Fat12Volume *volume, int fd, const StandardDirectoryEntry *entry) {
+    // Writes the file straight out of the image mapping, one write per extent.
+    // Only file_size_in_bytes is the file. The rest of the last cluster is just leftover data.
+    // Returns how many bytes couldn't be written, so 0 means the whole file made it.
+    uint32_t bytes_left = entry->file_size_in_bytes;
+
+    ClusterChain chain;
+    resolve_cluster_chain(volume, entry->first_cluster_number, &chain);
+
+    for(int i = 0; i < chain.extents_count && bytes_left > 0; i++) {
+        const ClusterExtent *extent = &chain.extents[i];
+        size_t extent_offset = volume->file_desc_data_section_offset + ((size_t) (extent->first_cluster_number - 2) * volume->bytes_per_cluster);
+        size_t extent_size = (size_t) extent->cluster_count * volume->bytes_per_cluster;
+        if(extent_size > bytes_left) extent_size = bytes_left;
+
+        const uint8_t *extent_data = image_bytes(volume, extent_offset, extent_size);
+        if(extent_data == NULL || write_all(fd, extent_data, extent_size) != 0) break;
+        STATS_ADD(volume, write_calls, 1);
+        STATS_ADD(volume, bytes_written, extent_size);
+
+        bytes_left -= extent_size;
+    }
+    free_cluster_chain(&chain);
+
+    return bytes_left;
+}
+
+int cat_path(Fat12Volume *volume, const char *path) {
+    DirectoryItem item;
+    int result = lookup_path(volume, path, &item);
+
+    if(result == 0) {
+        fprintf(stderr, "Error: %s not found\n", path);
+        return 1;
+    }
+    if(result == 2 || (item.entry->attribute & 0x10)) {
+        fprintf(stderr, "Error: %s is a directory\n", path);
+        return 1;
+    }
+
+    out_flush(volume->out);
+    uint32_t bytes_left = write_file_data(volume, STDOUT_FILENO, item.entry);
+
+    if(bytes_left > 0) {
+        fprintf(stderr, "Error: %s is %u bytes shorter than its directory entry says\n", path, bytes_left);
+        return 1;
+    }
+    return 0;
+}
+
+int ls_path(Fat12Volume *volume, const char *path, OutputFormat format) {
+    DirectoryItem item;
+    int result = lookup_path(volume, path, &item);
+
+    if(result == 0) {
+        fprintf(stderr, "Error: %s not found\n", path);
+        return 1;
+    }
+
+    if(format == FORMAT_JSON || format == FORMAT_CSV) {
+        print_records_header(volume, format);
+        if(result == 1 && !(item.entry->attribute & 0x10)) {
+            print_entry_record(volume, format, path, &item);
+            return 0;
+        }
+
+        DirectoryIterator iterator;
+        open_directory(volume, &iterator, result == 2 ? 0 : item.entry->first_cluster_number);
+
+        int path_length = strlen(path);
+        while(path_length > 0 && path[path_length - 1] == '/') path_length--;
+
+        while(next_directory_item(&iterator, &item)) {
+            char entry_path[PATH_MAX];
+            snprintf(entry_path, PATH_MAX, "%.*s/%s", path_length, path, item.long_name);
+            print_entry_record(volume, format, entry_path, &item);
+        }
+        close_directory(&iterator);
+        return 0;
+    }
+
+    // ls of a file just lists that file.
+    if(result == 1 && !(item.entry->attribute & 0x10)) {
+        char attribute[7];
+        format_attribute(item.entry->attribute, attribute);
+        out_printf(volume->out, "%s %10u %s\n", attribute, item.entry->file_size_in_bytes, item.long_name);
+        return 0;
+    }
+
+    DirectoryIterator iterator;
+    open_directory(volume, &iterator, result == 2 ? 0 : item.entry->first_cluster_number);
+
+    while(next_directory_item(&iterator, &item)) {
+        char attribute[7];
+        char modified[20];
+        format_attribute(item.entry->attribute, attribute);
+        format_fat_date_time(item.entry->last_modified_date, item.entry->last_modified_time, modified, sizeof(modified));
+        out_printf(volume->out, "%s %10u %s %s%s\n", attribute, item.entry->file_size_in_bytes, modified, item.long_name,
+                (item.entry->attribute & 0x10) ? "/" : "");
+    }
+    close_directory(&iterator);
+    return 0;
+}
+
+// Snapshot of the whole directory tree, for answering many queries about one image.
+// It's built once with one pass over every directory, and then ls / stat / tree / find never touch the image.
+// Every node, name and extent list comes out of one arena, so it's all freed at once.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t capacity;
+    uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks;
+    size_t bytes_used;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size) {
+    // Everything is 8-byte aligned. Anything that doesn't fit in the current block gets a new one,
+    // as big as it needs to be.
+    size = (size + 7) & ~(size_t) 7;
+
+    ArenaBlock *block = arena->blocks;
+    if(block == NULL || block->capacity - block->used < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *) malloc(sizeof(ArenaBlock) + capacity);
+        if(block == NULL) return NULL;
+        block->next = arena->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->blocks = block;
+    }
+
+    void *memory = block->data + block->used;
+    block->used += size;
+    arena->bytes_used += size;
+    return memory;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    size_t length = strlen(str) + 1;
+    char *copy = (char *) arena_alloc(arena, length);
+    if(copy != NULL) memcpy(copy, str, length);
+    return copy;
+}
+
+void arena_free(Arena *arena) {
+    while(arena->blocks != NULL) {
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->bytes_used = 0;
+}
+
+typedef struct TreeNode {
+    const char *name;
+    char short_name[13];
+    uint8_t attribute;
+    uint32_t size;
+    int first_cluster_number;
+    uint16_t created_date, created_time;
+    uint16_t modified_date, modified_time;
+    uint16_t accessed_date;
+
+    int clusters_count;
+    int extents_count;
+    ClusterExtent *extents;
+
+    // Children sit next to each other in one array, in directory order. "." and ".." are left out.
+    struct TreeNode *parent;
+    struct TreeNode *children;
+    int children_count;
+} TreeNode;
+
+typedef struct {
+    Arena arena;
+    TreeNode root;
+    int files_count;
+    int directories_count;
+} VolumeTree;
+
+int fill_tree_node(Fat12Volume *volume, VolumeTree *tree, TreeNode *node, TreeNode *parent, const DirectoryItem *item) {
+    const StandardDirectoryEntry *entry = item->entry;
+    ClusterChain chain;
+    resolve_cluster_chain(volume, entry->first_cluster_number, &chain);
+
+    *node = (TreeNode) { 0 };
+    node->name = arena_strdup(&tree->arena, item->long_name);
+    memcpy(node->short_name, item->short_name, sizeof(node->short_name));
+    node->attribute = entry->attribute;
+    node->size = entry->file_size_in_bytes;
+    node->first_cluster_number = entry->first_cluster_number;
+    node->created_date = entry->created_date;
+    node->created_time = entry->created_time;
+    node->modified_date = entry->last_modified_date;
+    node->modified_time = entry->last_modified_time;
+    node->accessed_date = entry->last_accessed_date;
+    node->clusters_count = chain.clusters_count;
+    node->extents_count = chain.extents_count;
+    node->extents = (ClusterExtent *) arena_alloc(&tree->arena, sizeof(ClusterExtent) * chain.extents_count);
+    node->parent = parent;
+
+    int status = node->name != NULL && (chain.extents_count == 0 || node->extents != NULL) ? 0 : -1;
+    if(status == 0 && chain.extents_count > 0) memcpy(node->extents, chain.extents, sizeof(ClusterExtent) * chain.extents_count);
+    free_cluster_chain(&chain);
+
+    if(node->attribute & 0x10) tree->directories_count++;
+    else tree->files_count++;
+    return status;
+}
+
+int build_volume_tree(Fat12Volume *volume, VolumeTree *tree) {
+    // Breadth first, with a queue of directories still to read instead of recursion.
+    // A directory's entries are gathered first, so its children can go into one array of the right size.
+    memset(tree, 0, sizeof(VolumeTree));
+    tree->root.name = "";
+    tree->root.attribute = 0x10;
+
+    int queue_capacity = 64;
+    int queue_start = 0, queue_end = 0;
+    TreeNode **queue = (TreeNode **) malloc(sizeof(TreeNode *) * queue_capacity);
+    queue[queue_end++] = &tree->root;
+
+    int items_capacity = 64;
+    DirectoryItem *items = (DirectoryItem *) malloc(sizeof(DirectoryItem) * items_capacity);
+
+    int directories_count = 0;
+    int status = 0;
+    while(status == 0 && queue_start < queue_end) {
+        TreeNode *directory = queue[queue_start++];
+
+        // A directory that loops back on an ancestor would be read forever.
+        if(++directories_count > volume->clusters_in_data_section + 1) {
+            fprintf(stderr, "Error: Directory tree loops back on itself\n");
+            status = -1;
+            break;
+        }
+
+        DirectoryIterator iterator;
+        open_directory(volume, &iterator, directory->first_cluster_number);
+        int items_count = 0;
+        while(next_directory_item(&iterator, &items[items_count])) {
+            const char *name = items[items_count].long_name;
+            if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+            if(++items_count == items_capacity) {
+                items_capacity *= 2;
+                items = (DirectoryItem *) realloc(items, sizeof(DirectoryItem) * items_capacity);
+            }
+        }
+
+        directory->children = (TreeNode *) arena_alloc(&tree->arena, sizeof(TreeNode) * (items_count > 0 ? items_count : 1));
+        directory->children_count = directory->children != NULL ? items_count : 0;
+        for(int i = 0; i < directory->children_count && status == 0; i++) {
+            TreeNode *child = &directory->children[i];
+            status = fill_tree_node(volume, tree, child, directory, &items[i]);
+
+            // A directory pointing at cluster 0 would be the Root Directory again.
+            if(!(child->attribute & 0x10) || child->first_cluster_number == 0) continue;
+
+            // Everything before queue_start is done, so slide the queue down before growing it.
+            if(queue_end == queue_capacity && queue_start > 0) {
+                memmove(queue, queue + queue_start, sizeof(TreeNode *) * (queue_end - queue_start));
+                queue_end -= queue_start;
+                queue_start = 0;
+            }
+            if(queue_end == queue_capacity) {
+                queue_capacity *= 2;
+                queue = (TreeNode **) realloc(queue, sizeof(TreeNode *) * queue_capacity);
+            }
+            queue[queue_end++] = child;
+        }
+        close_directory(&iterator);
+
+        if(directory->children == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            status = -1;
+        }
+    }
+
+    free(items);
+    free(queue);
+    return status;
+}
+
+void free_volume_tree(VolumeTree *tree) {
+    arena_free(&tree->arena);
+}
+
+TreeNode *find_tree_node(VolumeTree *tree, const char *path) {
+    // Same rules as lookup_path(): one component at a time, long or short name, any case.
+    TreeNode *node = &tree->root;
+
+    const char *component = path;
+    while(1) {
+        while(*component == '/') component++;
+        if(*component == '\0') return node;
+
+        int component_length = strcspn(component, "/");
+        if(component_length == 1 && component[0] == '.') {
+            component += component_length;
+            continue;
+        }
+        if(component_length == 2 && component[0] == '.' && component[1] == '.') {
+            if(node->parent != NULL) node = node->parent;
+            component += component_length;
+            continue;
+        }
+
+        TreeNode *found = NULL;
+        for(int i = 0; i < node->children_count && found == NULL; i++) {
+            if(names_match(node->children[i].name, component, component_length) ||
+               names_match(node->children[i].short_name, component, component_length)) {
+                found = &node->children[i];
+            }
+        }
+        if(found == NULL) return NULL;
+
+        node = found;
+        component += component_length;
+    }
+}
+
+void format_tree_path(const TreeNode *node, char *path, int path_size) {
+    // Walks up to the root, filling the path in from the end.
+    int position = path_size - 1;
+    path[position] = '\0';
+
+    for(; node != NULL && node->parent != NULL; node = node->parent) {
+        int length = strlen(node->name);
+        if(position < length + 1) break;
+        position -= length;
+        memcpy(path + position, node->name, length);
+        path[--position] = '/';
+    }
+    if(position == path_size - 1) path[--position] = '/';
+    memmove(path, path + position, path_size - position);
+}
+
+void print_tree_node_listing(Fat12Volume *volume, const TreeNode *node) {
+    char attribute[7];
+    char modified[20];
+    format_attribute(node->attribute, attribute);
+    format_fat_date_time(node->modified_date, node->modified_time, modified, sizeof(modified));
+    out_printf(volume->out, "%s %10u %s %s%s\n", attribute, node->size, modified, node->name,
+            (node->attribute & 0x10) ? "/" : "");
+}
+
+int tree_ls(Fat12Volume *volume, VolumeTree *tree, const char *path) {
+    TreeNode *node = find_tree_node(tree, path);
+    if(node == NULL) {
+        fprintf(stderr, "Error: %s not found\n", path);
+        return 1;
+    }
+
+    if(!(node->attribute & 0x10)) {
+        print_tree_node_listing(volume, node);
+        return 0;
+    }
+    for(int i = 0; i < node->children_count; i++) {
+        print_tree_node_listing(volume, &node->children[i]);
+    }
+    return 0;
+}
+
+int tree_stat(Fat12Volume *volume, VolumeTree *tree, const char *path) {
+    TreeNode *node = find_tree_node(tree, path);
+    if(node == NULL) {
+        fprintf(stderr, "Error: %s not found\n", path);
+        return 1;
+    }
+
+    char full_path[PATH_MAX];
+    format_tree_path(node, full_path, sizeof(full_path));
+    if(node == &tree->root) {
+        out_printf(volume->out, "Path               : /\n");
+        out_printf(volume->out, "Type               : root directory\n");
+        out_printf(volume->out, "Children           : %d\n", node->children_count);
+        return 0;
+    }
+
+    char attribute[7];
+    char created[20];
+    char modified[20];
+    char accessed[20];
+    format_attribute(node->attribute, attribute);
+    format_fat_date_time(node->created_date, node->created_time, created, sizeof(created));
+    format_fat_date_time(node->modified_date, node->modified_time, modified, sizeof(modified));
+    format_fat_date_time(node->accessed_date, 0, accessed, sizeof(accessed));
+
+    out_printf(volume->out, "Path               : %s\n", full_path);
+    out_printf(volume->out, "Long Name          : %s\n", node->name);
+    out_printf(volume->out, "Short Name         : %s\n", node->short_name);
+    out_printf(volume->out, "Type               : %s\n", (node->attribute & 0x10) ? "directory" : "file");
+    out_printf(volume->out, "Attributes         : %s (0x%02X)\n", attribute, node->attribute);
+    out_printf(volume->out, "Size in Bytes      : %u\n", node->size);
+    out_printf(volume->out, "First Cluster      : %d\n", node->first_cluster_number);
+    out_printf(volume->out, "Clusters           : %d\n", node->clusters_count);
+    out_printf(volume->out, "Extents            : %d\n", node->extents_count);
+    if(node->attribute & 0x10) out_printf(volume->out, "Children           : %d\n", node->children_count);
+    out_printf(volume->out, "Created            : %s\n", created);
+    out_printf(volume->out, "Modified           : %s\n", modified);
+    out_printf(volume->out, "Accessed           : %.10s\n", accessed);
+    return 0;
+}
+
+// One level of the walk in tree_print() and tree_totals(): a directory, and the next child to look at.
+typedef struct {
+    const TreeNode *directory;
+    int next_child;
+} TreeWalkLevel;
+
+int tree_print(Fat12Volume *volume, VolumeTree *tree, const char *path) {
+    // Like tree(1). Depth first with an explicit stack, so a deep tree can't blow the C stack.
+    // The stack already knows which ancestors have more children coming, and that's all the indent needs.
+    TreeNode *node = find_tree_node(tree, path);
+    if(node == NULL) {
+        fprintf(stderr, "Error: %s not found\n", path);
+        return 1;
+    }
+
+    char full_path[PATH_MAX];
+    format_tree_path(node, full_path, sizeof(full_path));
+    out_printf(volume->out, "%s%s\n", full_path, (node->attribute & 0x10) && node != &tree->root ? "/" : "");
+    if(!(node->attribute & 0x10)) return 0;
+
+    int levels_capacity = 16;
+    int levels_count = 1;
+    TreeWalkLevel *levels = (TreeWalkLevel *) malloc(sizeof(TreeWalkLevel) * levels_capacity);
+    levels[0] = (TreeWalkLevel) { node, 0 };
+
+    while(levels_count > 0) {
+        TreeWalkLevel *level = &levels[levels_count - 1];
+        if(level->next_child >= level->directory->children_count) {
+            levels_count--;
+            continue;
+        }
+
+        const TreeNode *child = &level->directory->children[level->next_child++];
+        for(int i = 0; i < levels_count - 1; i++) {
+            out_write(volume->out, levels[i].next_child < levels[i].directory->children_count ? "|   " : "    ", 4);
+        }
+        out_printf(volume->out, "%s%s%s\n", level->next_child < level->directory->children_count ? "|-- " : "`-- ",
+                child->name, (child->attribute & 0x10) ? "/" : "");
+
+        if((child->attribute & 0x10) && child->children_count > 0) {
+            if(levels_count == levels_capacity) {
+                levels_capacity *= 2;
+                levels = (TreeWalkLevel *) realloc(levels, sizeof(TreeWalkLevel) * levels_capacity);
+            }
+            levels[levels_count++] = (TreeWalkLevel) { child, 0 };
+        }
+    }
+
+    free(levels);
+    return 0;
+}
+
+int tree_find(Fat12Volume *volume, VolumeTree *tree, const char *text) {
+    // Every path whose name contains text, ignoring case. Breadth first, straight over the child arrays.
+    int text_length = strlen(text);
+    int matches_count = 0;
+
+    int queue_capacity = 64;
+    int queue_start = 0, queue_end = 0;
+    const TreeNode **queue = (const TreeNode **) malloc(sizeof(TreeNode *) * queue_capacity);
+    queue[queue_end++] = &tree->root;
+
+    while(queue_start < queue_end) {
+        const TreeNode *directory = queue[queue_start++];
+        for(int i = 0; i < directory->children_count; i++) {
+            const TreeNode *child = &directory->children[i];
+
+            int is_match = 0;
+            for(const char *start = child->name; !is_match && *start != '\0'; start++) {
+                is_match = strncasecmp(start, text, text_length) == 0;
+            }
+            if(is_match) {
+                char path[PATH_MAX];
+                format_tree_path(child, path, sizeof(path));
+                out_printf(volume->out, "%s%s\n", path, (child->attribute & 0x10) ? "/" : "");
+                matches_count++;
+            }
+
+            if(child->children_count == 0) continue;
+            if(queue_end == queue_capacity && queue_start > 0) {
+                memmove(queue, queue + queue_start, sizeof(TreeNode *) * (queue_end - queue_start));
+                queue_end -= queue_start;
+                queue_start = 0;
+            }
+            if(queue_end == queue_capacity) {
+                queue_capacity *= 2;
+                queue = (const TreeNode **) realloc(queue, sizeof(TreeNode *) * queue_capacity);
+            }
+            queue[queue_end++] = child;
+        }
+    }
+
+    free(queue);
+    return matches_count > 0 ? 0 : 1;
+}
+
+int tree_totals(Fat12Volume *volume, VolumeTree *tree, const char *path) {
+    // Like du: everything under path, added up.
+    TreeNode *node = find_tree_node(tree, path);
+    if(node == NULL) {
+        fprintf(stderr, "Error: %s not found\n", path);
+        return 1;
+    }
+
+    int files_count = 0, directories_count = 0, fragmented_count = 0, deepest = 0;
+    uint64_t bytes_count = 0, clusters_count = 0;
+
+    int levels_capacity = 16;
+    int levels_count = 1;
+    TreeWalkLevel *levels = (TreeWalkLevel *) malloc(sizeof(TreeWalkLevel) * levels_capacity);
+    levels[0] = (TreeWalkLevel) { node, 0 };
+    if(!(node->attribute & 0x10)) levels_count = 0;
+
+    const TreeNode *single_file = levels_count == 0 ? node : NULL;
+    while(levels_count > 0 || single_file != NULL) {
+        const TreeNode *child = single_file;
+        single_file = NULL;
+
+        if(child == NULL) {
+            TreeWalkLevel *level = &levels[levels_count - 1];
+            if(level->next_child >= level->directory->children_count) {
+                levels_count--;
+                continue;
+            }
+            child = &level->directory->children[level->next_child++];
+            if(levels_count > deepest) deepest = levels_count;
+        }
+
+        clusters_count += child->clusters_count;
+        if(child->extents_count > 1) fragmented_count++;
+        if(child->attribute & 0x10) {
+            directories_count++;
+            if(child->children_count == 0) continue;
+            if(levels_count == levels_capacity) {
+                levels_capacity *= 2;
+                levels = (TreeWalkLevel *) realloc(levels, sizeof(TreeWalkLevel) * levels_capacity);
+            }
+            levels[levels_count++] = (TreeWalkLevel) { child, 0 };
+        } else {
+            files_count++;
+            bytes_count += child->size;
+        }
+    }
+    free(levels);
+
+    out_printf(volume->out, "Files               : %d\n", files_count);
+    out_printf(volume->out, "Directories         : %d\n", directories_count);
+    out_printf(volume->out, "Bytes in Files      : %llu\n", (unsigned long long) bytes_count);
+    out_printf(volume->out, "Clusters            : %llu\n", (unsigned long long) clusters_count);
+    out_printf(volume->out, "Fragmented Entries  : %d\n", fragmented_count);
+    out_printf(volume->out, "Deepest Level       : %d\n", deepest);
+    out_printf(volume->out, "Snapshot Size       : %zu bytes\n", tree->arena.bytes_used);
+    return 0;
+}
+
+int run_tree_query(Fat12Volume *volume, VolumeTree *tree, char *line) {
+    // "<command> [argument]". The argument is the rest of the line, so names can have spaces in them.
+    line[strcspn(line, "\r\n")] = '\0';
+    while(*line == ' ' || *line == '\t') line++;
+    if(*line == '\0' || *line == '#') return 0;
+
+    char *argument = line + strcspn(line, " \t");
+    if(*argument != '\0') *argument++ = '\0';
+    while(*argument == ' ' || *argument == '\t') argument++;
+    const char *path = *argument != '\0' ? argument : "/";
+
+    if(strcmp(line, "ls") == 0) return tree_ls(volume, tree, path);
+    if(strcmp(line, "stat") == 0) return tree_stat(volume, tree, path);
+    if(strcmp(line, "tree") == 0) return tree_print(volume, tree, path);
+    if(strcmp(line, "du") == 0) return tree_totals(volume, tree, path);
+    if(strcmp(line, "find") == 0 && *argument != '\0') return tree_find(volume, tree, argument);
+
+    fprintf(stderr, "Error: Unknown query: %s (ls|stat|tree|du [path], find <text>)\n", line);
+    return 1;
+}
+
+int query_volume(Fat12Volume *volume, FILE *input) {
+    // Builds the snapshot once, then answers one query per line until the input ends.
+    // Output is flushed after every query, so a program on the other end of a pipe gets its answer right away.
+    VolumeTree tree;
+    if(build_volume_tree(volume, &tree) != 0) {
+        free_volume_tree(&tree);
+        return 1;
+    }
+
+    int status = 0;
+    char line[PATH_MAX + 16];
+    while(fgets(line, sizeof(line), input) != NULL) {
+        status |= run_tree_query(volume, &tree, line);
+        out_flush(volume->out);
+    }
+
+    free_volume_tree(&tree);
+    return status;
+}
+
+int print_volume_tree(Fat12Volume *volume, const char *path) {
+    VolumeTree tree;
+    int status = build_volume_tree(volume, &tree) != 0 || tree_print(volume, &tree, path) != 0;
+    free_volume_tree(&tree);
+    return status;
+}
+
+// Random access to a single file. fat12_open() walks the chain once, and keeps it as a table of
+// extents with the file offset each one starts at. A read at any offset is then a binary search
+// over the extents (usually 1), instead of a walk from the first cluster.
+typedef struct {
+    Fat12Volume *volume;
+    uint32_t size;
+
+    ClusterExtent *extents;
+    uint32_t *extent_file_offsets;
+    int extents_count;
+
+    // Reads tend to be sequential, so the last extent used is tried first.
+    int last_extent_index;
+} Fat12File;
+
+Fat12File *fat12_open(Fat12Volume *volume, const char *path) {
+    // Returns NULL with errno set to ENOENT or EISDIR if path isn't a file.
+    DirectoryItem item;
+    int result = lookup_path(volume, path, &item);
+    if(result == 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if(result == 2 || (item.entry->attribute & 0x10)) {
+        errno = EISDIR;
+        return NULL;
+    }
+
+    Fat12File *file = (Fat12File *) calloc(1, sizeof(Fat12File));
+    if(file == NULL) return NULL;
+    file->volume = volume;
+    file->size = item.entry->file_size_in_bytes;
+
+    // The extents array of the chain is kept as it is. Only the offsets are new.
+    ClusterChain chain;
+    resolve_cluster_chain(volume, item.entry->first_cluster_number, &chain);
+    file->extents = chain.extents;
+    file->extents_count = chain.extents_count;
+    file->extent_file_offsets = (uint32_t *) malloc(sizeof(uint32_t) * (chain.extents_count > 0 ? chain.extents_count : 1));
+    if(file->extent_file_offsets == NULL) {
+        free(file->extents);
+        free(file);
+        return NULL;
+    }
+
+    uint64_t file_offset = 0;
+    for(int i = 0; i < file->extents_count; i++) {
+        file->extent_file_offsets[i] = file_offset < UINT32_MAX ? (uint32_t) file_offset : UINT32_MAX;
+        file_offset += (uint64_t) file->extents[i].cluster_count * volume->bytes_per_cluster;
+    }
+
+    // A chain shorter than the file size can only be read up to where it ends.
+    if(file_offset < file->size) file->size = (uint32_t) file_offset;
+    return file;
+}
+
+int find_file_extent(Fat12File *file, uint32_t offset) {
+    // The last extent that starts at or before offset.
+    int index = file->last_extent_index;
+    if(index < file->extents_count && file->extent_file_offsets[index] <= offset &&
+       (index + 1 == file->extents_count || offset < file->extent_file_offsets[index + 1])) {
+        STATS_ADD(file->volume, extent_hint_hits, 1);
+        return index;
+    }
+    STATS_ADD(file->volume, extent_hint_misses, 1);
+
+    int low = 0;
+    int high = file->extents_count - 1;
+    while(low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if(file->extent_file_offsets[middle] <= offset) low = middle;
+        else high = middle - 1;
+    }
+    file->last_extent_index = low;
+    return low;
+}
+
+ssize_t fat12_pread(Fat12File *file, void *buffer, size_t count, uint32_t offset) {
+    // Like pread(): copies up to count bytes from offset, and returns how many. 0 at the end of the file.
+    Fat12Volume *volume = file->volume;
+    if(offset >= file->size) return 0;
+    if(count > file->size - offset) count = file->size - offset;
+
+    size_t copied = 0;
+    int index = find_file_extent(file, offset);
+    while(copied < count && index < file->extents_count) {
+        const ClusterExtent *extent = &file->extents[index];
+        size_t extent_size = (size_t) extent->cluster_count * volume->bytes_per_cluster;
+        size_t offset_in_extent = offset + copied - file->extent_file_offsets[index];
+        size_t length = extent_size - offset_in_extent;
+        if(length > count - copied) length = count - copied;
+
+        size_t extent_offset = volume->file_desc_data_section_offset + ((size_t) (extent->first_cluster_number - 2) * volume->bytes_per_cluster);
+        const uint8_t *data = image_bytes(volume, extent_offset + offset_in_extent, length);
+        if(data == NULL) break;
+
+        memcpy((uint8_t *) buffer + copied, data, length);
+        copied += length;
+        if(offset_in_extent + length == extent_size) index++;
+    }
+
+    file->last_extent_index = index < file->extents_count ? index : file->extents_count - 1;
+    if(copied == 0 && count > 0) {
+        errno = EIO;
+        return -1;
+    }
+    return copied;
+}
+
+void fat12_close(Fat12File *file) {
+    if(file == NULL) return;
+    free(file->extents);
+    free(file->extent_file_offsets);
+    free(file);
+}
+
+int read_path_range(Fat12Volume *volume, const char *path, const char *offset_text, const char *length_text) {
+    // Writes length bytes of the file at path, starting at offset, to stdout. Less if the file ends first.
+    char *offset_end;
+    char *length_end;
+    unsigned long long offset = strtoull(offset_text, &offset_end, 0);
+    unsigned long long length = strtoull(length_text, &length_end, 0);
+    if(*offset_text == '\0' || *offset_end != '\0' || *length_text == '\0' || *length_end != '\0' || offset > UINT32_MAX) {
+        fprintf(stderr, "Error: Offset and length must be numbers\n");
+        return 1;
+    }
+
+    Fat12File *file = fat12_open(volume, path);
+    if(file == NULL) {
+        fprintf(stderr, "Error: %s %s\n", path, errno == EISDIR ? "is a directory" : "not found");
+        return 1;
+    }
+
+    int status = 0;
+    uint8_t chunk[64 * 1024];
+    while(length > 0) {
+        ssize_t bytes_read = fat12_pread(file, chunk, length < sizeof(chunk) ? length : sizeof(chunk), offset);
+        if(bytes_read < 0) {
+            fprintf(stderr, "Error: %s: Could not read at offset %llu\n", path, offset);
+            status = 1;
+        }
+        if(bytes_read <= 0) break;
+
+        out_write(volume->out, chunk, bytes_read);
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+
+    fat12_close(file);
+    return status;
+}
+
+// Runs work(job_index, context) for every job, spread over one thread per core.
+// Every worker starts with its own contiguous slice of the jobs. When it runs out, it steals
+// the back half of another worker's slice, so a few slow jobs (a huge image, a big file)
+// don't leave the other cores idle.
+typedef struct {
+    pthread_mutex_t lock;
+    int next_job_index;
+    int end_job_index;
+} WorkQueue;
+
+typedef struct {
+    WorkQueue *queues;
+    int queues_count;
+    void (*work)(int job_index, void *context);
+    void *context;
+} WorkStealingPool;
+
+typedef struct {
+    WorkStealingPool *pool;
+    int worker_index;
+} PoolWorker;
+
+// 0 means one thread per core. Set with --threads=N.
+int threads_override = 0;
+
+int pop_own_job(WorkQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    int job_index = queue->next_job_index < queue->end_job_index ? queue->next_job_index++ : -1;
+    pthread_mutex_unlock(&queue->lock);
+    return job_index;
+}
+
+int steal_jobs(WorkStealingPool *pool, int thief_index) {
+    for(int i = 1; i < pool->queues_count; i++) {
+        WorkQueue *victim = &pool->queues[(thief_index + i) % pool->queues_count];
+
+        pthread_mutex_lock(&victim->lock);
+        int remaining = victim->end_job_index - victim->next_job_index;
+        int stolen_end = victim->end_job_index;
+        if(remaining > 0) {
+            victim->end_job_index -= (remaining + 1) / 2;
+        }
+        int stolen_start = victim->end_job_index;
+        pthread_mutex_unlock(&victim->lock);
+
+        if(remaining > 0) {
+            WorkQueue *own = &pool->queues[thief_index];
+            pthread_mutex_lock(&own->lock);
+            own->next_job_index = stolen_start;
+            own->end_job_index = stolen_end;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void *work_stealing_worker(void *argument) {
+    PoolWorker *worker = (PoolWorker *) argument;
+    WorkStealingPool *pool = worker->pool;
+
+    while(1) {
+        int job_index = pop_own_job(&pool->queues[worker->worker_index]);
+        if(job_index < 0) {
+            // Jobs never create more jobs, so if nobody has any left, everything is handed out.
+            if(!steal_jobs(pool, worker->worker_index)) break;
+            continue;
+        }
+        pool->work(job_index, pool->context);
+    }
+    return NULL;
+}
+
+int count_worker_threads(int jobs_count) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads_count = threads_override > 0 ? threads_override : (cores > 0 ? (int) cores : 1);
+    if(threads_count > 256) threads_count = 256;
+    if(threads_count > jobs_count) threads_count = jobs_count;
+    return threads_count;
+}
+
+void run_in_parallel(int jobs_count, void (*work)(int job_index, void *context), void *context) {
+    int threads_count = count_worker_threads(jobs_count);
+    if(threads_count <= 0) return;
+
+    WorkQueue queues[256];
+    PoolWorker workers[256];
+    pthread_t threads[256];
+    WorkStealingPool pool = { queues, threads_count, work, context };
+
+    for(int i = 0; i < threads_count; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        queues[i].next_job_index = (int) ((long long) jobs_count * i / threads_count);
+        queues[i].end_job_index = (int) ((long long) jobs_count * (i + 1) / threads_count);
+        workers[i] = (PoolWorker) { &pool, i };
+    }
+
+    // The calling thread is worker 0. If a thread can't be started, its slice just gets stolen.
+    int started = 1;
+    for(; started < threads_count; started++) {
+        if(pthread_create(&threads[started], NULL, work_stealing_worker, &workers[started]) != 0) break;
+    }
+    work_stealing_worker(&workers[0]);
+
+    for(int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for(int i = 0; i < threads_count; i++) {
+        pthread_mutex_destroy(&queues[i].lock);
+    }
+}
+
+// Whole volume extraction. The directory tree is walked once, creating host directories
+// and collecting one job per file. The files are then written out in parallel.
+typedef struct {
+    char host_path[PATH_MAX];
+    const StandardDirectoryEntry *entry;
+    time_t modified;
+} ExtractJob;
+
+typedef struct {
+    Fat12Volume *volume;
+    const char *output_directory;
+    int status;
+
+    ExtractJob *jobs;
+    int jobs_count;
+    int jobs_capacity;
+    int directories_count;
+    atomic_int failed_count;
+    atomic_ullong bytes_written;
+} ExtractPlan;
+
+time_t fat_date_time_to_time(uint16_t date, uint16_t time) {
+    // FAT timestamps are local time.
+    struct tm broken_down = { 0 };
+    broken_down.tm_year = 80 + (date >> 9);
+    broken_down.tm_mon = ((date >> 5) & 0x0F) - 1;
+    broken_down.tm_mday = date & 0x1F;
+    broken_down.tm_hour = time >> 11;
+    broken_down.tm_min = (time >> 5) & 0x3F;
+    broken_down.tm_sec = (time & 0x1F) * 2;
+    broken_down.tm_isdst = -1;
+    return mktime(&broken_down);
+}
+
+void extract_one_file(int job_index, void *context) {
+    ExtractPlan *plan = (ExtractPlan *) context;
+    Fat12Volume *volume = plan->volume;
+    const ExtractJob *job = &plan->jobs[job_index];
+
+    int fd = open(job->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "Error: Could not create %s\n", job->host_path);
+        atomic_fetch_add(&plan->failed_count, 1);
+        return;
+    }
+
+    uint32_t bytes_left = write_file_data(volume, fd, job->entry);
+    if(bytes_left > 0) {
+        fprintf(stderr, "Error: Could not write all of %s\n", job->host_path);
+        atomic_fetch_add(&plan->failed_count, 1);
+    }
+    atomic_fetch_add(&plan->bytes_written, job->entry->file_size_in_bytes - bytes_left);
+
+    struct timespec times[2] = { { job->modified, 0 }, { job->modified, 0 } };
+    futimens(fd, times);
+    close(fd);
+}
+
+int plan_extraction_entry(Fat12Volume *volume, const char *path, const DirectoryItem *item, void *context) {
+    ExtractPlan *plan = (ExtractPlan *) context;
+
+    char host_path[PATH_MAX];
+    if(snprintf(host_path, PATH_MAX, "%s%s", plan->output_directory, path) >= PATH_MAX) {
+        fprintf(stderr, "Error: Path too long: %s%s\n", plan->output_directory, path);
+        plan->status = -1;
+        return 1;
+    }
+
+    if(item->entry->attribute & 0x10) {
+        if(mkdir(host_path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Could not create directory %s\n", host_path);
+            plan->status = -1;
+            return 1;
+        }
+        plan->directories_count++;
+        return 0;
+    }
+
+    if(plan->jobs_count == plan->jobs_capacity) {
+        plan->jobs_capacity = plan->jobs_capacity > 0 ? 2 * plan->jobs_capacity : 64;
+        plan->jobs = (ExtractJob *) realloc(plan->jobs, sizeof(ExtractJob) * plan->jobs_capacity);
+    }
+    memcpy(plan->jobs[plan->jobs_count].host_path, host_path, PATH_MAX);
+    plan->jobs[plan->jobs_count].entry = item->entry;
+    // mktime() touches the timezone state, so it's done here on one thread, not in the workers.
+    plan->jobs[plan->jobs_count].modified = fat_date_time_to_time(item->entry->last_modified_date, item->entry->last_modified_time);
+    plan->jobs_count++;
+    return 0;
+}
+
+int extract_volume(Fat12Volume *volume, const char *output_directory) {
+    ExtractPlan plan = { 0 };
+    plan.volume = volume;
+    plan.output_directory = output_directory;
+
+    if(mkdir(output_directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Could not create directory %s\n", output_directory);
+        return 1;
+    }
+
+    int status = walk_volume_tree(volume, plan_extraction_entry, &plan);
+    if(plan.status != 0) status = -1;
+    run_in_parallel(plan.jobs_count, extract_one_file, &plan);
+
+    out_printf(volume->out, "Extracted %d files, %d directories, %llu bytes into %s\n",
+            plan.jobs_count, plan.directories_count, (unsigned long long) plan.bytes_written, output_directory);
+
+    if(plan.failed_count > 0) status = -1;
+    free(plan.jobs);
+    return status != 0;
+}
+
+// grep: searches file contents straight out of the image, without extracting anything.
+// Only the first file_size_in_bytes of each chain is searched, never the leftovers at the end of the last cluster.
+// Every file is a job on the work-stealing pool. Each job keeps its matches in its own buffer,
+// and they're printed in walk order once all jobs are done, so the output doesn't depend on the threads.
+typedef struct {
+    char path[PATH_MAX];
+    const StandardDirectoryEntry *entry;
+    OutputBuffer out;
+    int matches_count;
+} GrepJob;
+
+typedef struct {
+    Fat12Volume *volume;
+    OutputFormat format;
+    const uint8_t *pattern;
+    size_t pattern_length;
+
+    GrepJob *jobs;
+    int jobs_count;
+    int jobs_capacity;
+} GrepPlan;
+
+void report_grep_match(GrepPlan *plan, GrepJob *job, uint64_t offset) {
+    job->matches_count++;
+    if(plan->format == FORMAT_JSON) {
+        out_printf(&job->out, "{\"path\":");
+        out_json_string(&job->out, job->path);
+        out_printf(&job->out, ",\"offset\":%llu}\n", (unsigned long long) offset);
+    } else {
+        out_printf(&job->out, "%s:%llu\n", job->path, (unsigned long long) offset);
+    }
+}
+
+void search_block(GrepPlan *plan, GrepJob *job, const uint8_t *data, size_t size, uint64_t file_offset) {
+    // Every offset in data where the pattern starts, including overlapping ones.
+    const uint8_t *pattern = plan->pattern;
+    size_t pattern_length = plan->pattern_length;
+    if(size < pattern_length) return;
+    size_t last_start = size - pattern_length;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // 16 start positions at a time: only where both the first and the last byte of the pattern match
+    // is the rest compared. That skips almost everything in text that doesn't contain the pattern.
+    __m128i first_byte = _mm_set1_epi8((char) pattern[0]);
+    __m128i last_byte = _mm_set1_epi8((char) pattern[pattern_length - 1]);
+    for(; i + 16 <= last_start + 1; i += 16) {
+        __m128i firsts = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i lasts = _mm_loadu_si128((const __m128i *) (data + i + pattern_length - 1));
+        int candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(firsts, first_byte), _mm_cmpeq_epi8(lasts, last_byte)));
+
+        while(candidates != 0) {
+            size_t start = i + __builtin_ctz(candidates);
+            if(pattern_length <= 2 || memcmp(data + start + 1, pattern + 1, pattern_length - 2) == 0) {
+                report_grep_match(plan, job, file_offset + start);
+            }
+            candidates &= candidates - 1;
+        }
+    }
+#endif
+
+    while(i <= last_start) {
+        const uint8_t *found = (const uint8_t *) memchr(data + i, pattern[0], last_start + 1 - i);
+        if(found == NULL) break;
+
+        size_t start = found - data;
+        if(memcmp(found, pattern, pattern_length) == 0) report_grep_match(plan, job, file_offset + start);
+        i = start + 1;
+    }
+}
+
+void grep_one_file(int job_index, void *context) {
+    GrepPlan *plan = (GrepPlan *) context;
+    Fat12Volume *volume = plan->volume;
+    GrepJob *job = &plan->jobs[job_index];
+    size_t pattern_length = plan->pattern_length;
+
+    ClusterChain chain;
+    resolve_cluster_chain(volume, job->entry->first_cluster_number, &chain);
+
+    // A match can start at the end of one extent and finish in the next. The last pattern_length - 1
+    // bytes of each extent are carried over, and searched together with the start of the next one.
+    // Only matches that start in the carried bytes come from there, the rest are found in the extent itself.
+    uint8_t carry[2 * 256];
+    size_t carry_length = 0;
+    uint64_t carry_offset = 0;
+
+    uint32_t bytes_left = job->entry->file_size_in_bytes;
+    uint64_t file_offset = 0;
+    for(int i = 0; i < chain.extents_count && bytes_left > 0; i++) {
+        const ClusterExtent *extent = &chain.extents[i];
+        size_t extent_size = (size_t) extent->cluster_count * volume->bytes_per_cluster;
+        if(extent_size > bytes_left) extent_size = bytes_left;
+
+        size_t extent_offset = volume->file_desc_data_section_offset + ((size_t) (extent->first_cluster_number - 2) * volume->bytes_per_cluster);
+        const uint8_t *data = image_bytes(volume, extent_offset, extent_size);
+        if(data == NULL) break;
+
+        if(carry_length > 0) {
+            size_t head_length = extent_size < pattern_length - 1 ? extent_size : pattern_length - 1;
+            memcpy(carry + carry_length, data, head_length);
+
+            // Searching carry + head only finds matches that start in carry, since it's shorter than 2 patterns.
+            search_block(plan, job, carry, carry_length + head_length, carry_offset);
+        }
+        search_block(plan, job, data, extent_size, file_offset);
+
+        // Keep the last pattern_length - 1 bytes of everything so far. A short extent adds to the old carry.
+        if(extent_size >= pattern_length - 1) {
+            carry_length = pattern_length - 1;
+            memcpy(carry, data + extent_size - carry_length, carry_length);
+            carry_offset = file_offset + extent_size - carry_length;
+        } else {
+            size_t kept = carry_length + extent_size > pattern_length - 1 ? pattern_length - 1 - extent_size : carry_length;
+            memmove(carry, carry + carry_length - kept, kept);
+            memcpy(carry + kept, data, extent_size);
+            carry_length = kept + extent_size;
+            carry_offset = file_offset + extent_size - carry_length;
+        }
+
+        file_offset += extent_size;
+        bytes_left -= extent_size;
+    }
+    free_cluster_chain(&chain);
+}
+
+int plan_grep_entry(Fat12Volume *volume, const char *path, const DirectoryItem *item, void *context) {
+    GrepPlan *plan = (GrepPlan *) context;
+    if((item->entry->attribute & 0x10) || item->entry->file_size_in_bytes < plan->pattern_length) return 0;
+
+    if(plan->jobs_count == plan->jobs_capacity) {
+        plan->jobs_capacity = plan->jobs_capacity > 0 ? 2 * plan->jobs_capacity : 64;
+        plan->jobs = (GrepJob *) realloc(plan->jobs, sizeof(GrepJob) * plan->jobs_capacity);
+    }
+    GrepJob *job = &plan->jobs[plan->jobs_count++];
+    strcpy(job->path, path);
+    job->entry = item->entry;
+    job->out = (OutputBuffer) { -1, NULL, 0, 0 };
+    job->matches_count = 0;
+    return 0;
+}
+
+int grep_volume(Fat12Volume *volume, const char *pattern, OutputFormat format) {
+    // Prints path:offset for every match. Exits 0 if anything matched, like grep.
+    GrepPlan plan = { 0 };
+    plan.volume = volume;
+    plan.format = format;
+    plan.pattern = (const uint8_t *) pattern;
+    plan.pattern_length = strlen(pattern);
+
+    // The carry buffer in grep_one_file() holds two patterns' worth. Nothing that long is a sensible search anyway.
+    if(plan.pattern_length == 0 || plan.pattern_length > 256) {
+        fprintf(stderr, "Error: Pattern has to be 1 to 256 bytes\n");
+        return 2;
+    }
+
+    int status = walk_volume_tree(volume, plan_grep_entry, &plan);
+    run_in_parallel(plan.jobs_count, grep_one_file, &plan);
+
+    int matches_count = 0;
+    for(int i = 0; i < plan.jobs_count; i++) {
+        out_write(volume->out, plan.jobs[i].out.data, plan.jobs[i].out.size);
+        free(plan.jobs[i].out.data);
+        matches_count += plan.jobs[i].matches_count;
+    }
+    free(plan.jobs);
+
+    if(status != 0) return 2;
+    return matches_count > 0 ? 0 : 1;
+}
+
+// Content hashes for manifest and diff. This is XXH64: 64 bits, fast, and the same hash that
+// xxhsum -H1 prints, so a manifest can be checked against files extracted on the host.
+#define XXH_PRIME_1 11400714785074694791ull
+#define XXH_PRIME_2 14029467366897019727ull
+#define XXH_PRIME_3 1609587929392839161ull
+#define XXH_PRIME_4 9650029242287828579ull
+#define XXH_PRIME_5 2870177450012600261ull
+
+typedef struct {
+    uint64_t lanes[4];
+    uint8_t buffer[32];
+    size_t buffered;
+    uint64_t total_length;
+} ContentHash;
+
+uint64_t rotate_left(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t read_u64(const uint8_t *data) {
+    uint64_t value;
+    memcpy(&value, data, 8);
+    return value;
+}
+
+uint64_t xxh_round(uint64_t lane, uint64_t input) {
+    lane += input * XXH_PRIME_2;
+    return rotate_left(lane, 31) * XXH_PRIME_1;
+}
+
+uint64_t xxh_merge_round(uint64_t hash, uint64_t lane) {
+    hash ^= xxh_round(0, lane);
+    return hash * XXH_PRIME_1 + XXH_PRIME_4;
+}
+
+void content_hash_init(ContentHash *hash) {
+    hash->lanes[0] = XXH_PRIME_1 + XXH_PRIME_2;
+    hash->lanes[1] = XXH_PRIME_2;
+    hash->lanes[2] = 0;
+    hash->lanes[3] = -XXH_PRIME_1;
+    hash->buffered = 0;
+    hash->total_length = 0;
+}
+
+void content_hash_update(ContentHash *hash, const uint8_t *data, size_t size) {
+    // Four independent lanes over 32-byte stripes. Leftovers wait in the buffer for the next extent.
+    hash->total_length += size;
+
+    if(hash->buffered > 0) {
+        size_t taken = 32 - hash->buffered < size ? 32 - hash->buffered : size;
+        memcpy(hash->buffer + hash->buffered, data, taken);
+        hash->buffered += taken;
+        data += taken;
+        size -= taken;
+        if(hash->buffered < 32) return;
+
+        for(int lane = 0; lane < 4; lane++) hash->lanes[lane] = xxh_round(hash->lanes[lane], read_u64(hash->buffer + 8 * lane));
+        hash->buffered = 0;
+    }
+
+    uint64_t lanes[4] = { hash->lanes[0], hash->lanes[1], hash->lanes[2], hash->lanes[3] };
+    for(; size >= 32; data += 32, size -= 32) {
+        lanes[0] = xxh_round(lanes[0], read_u64(data));
+        lanes[1] = xxh_round(lanes[1], read_u64(data + 8));
+        lanes[2] = xxh_round(lanes[2], read_u64(data + 16));
+        lanes[3] = xxh_round(lanes[3], read_u64(data + 24));
+    }
+    memcpy(hash->lanes, lanes, sizeof(lanes));
+
+    memcpy(hash->buffer, data, size);
+    hash->buffered = size;
+}
+
+uint64_t content_hash_final(const ContentHash *hash) {
+    uint64_t result;
+    if(hash->total_length >= 32) {
+        result = rotate_left(hash->lanes[0], 1) + rotate_left(hash->lanes[1], 7) +
+                 rotate_left(hash->lanes[2], 12) + rotate_left(hash->lanes[3], 18);
+        for(int lane = 0; lane < 4; lane++) result = xxh_merge_round(result, hash->lanes[lane]);
+    } else {
+        result = XXH_PRIME_5;
+    }
+    result += hash->total_length;
+
+    const uint8_t *data = hash->buffer;
+    size_t size = hash->buffered;
+    for(; size >= 8; data += 8, size -= 8) {
+        result ^= xxh_round(0, read_u64(data));
+        result = rotate_left(result, 27) * XXH_PRIME_1 + XXH_PRIME_4;
+    }
+    if(size >= 4) {
+        uint32_t value;
+        memcpy(&value, data, 4);
+        result ^= (uint64_t) value * XXH_PRIME_1;
+        result = rotate_left(result, 23) * XXH_PRIME_2 + XXH_PRIME_3;
+        data += 4;
+        size -= 4;
+    }
+    for(; size > 0; data++, size--) {
+        result ^= *data * XXH_PRIME_5;
+        result = rotate_left(result, 11) * XXH_PRIME_1;
+    }
+
+    result ^= result >> 33;
+    result *= XXH_PRIME_2;
+    result ^= result >> 29;
+    result *= XXH_PRIME_3;
+    result ^= result >> 32;
+    return result;
+}
+
+uint64_t hash_file_data(Fat12Volume *volume, const StandardDirectoryEntry *entry) {
+    // Hashes the file straight out of the image, one extent at a time, up to file_size_in_bytes.
+    ContentHash hash;
+    content_hash_init(&hash);
+
+    ClusterChain chain;
+    resolve_cluster_chain(volume, entry->first_cluster_number, &chain);
+
+    uint32_t bytes_left = entry->file_size_in_bytes;
+    for(int i = 0; i < chain.extents_count && bytes_left > 0; i++) {
+        const ClusterExtent *extent = &chain.extents[i];
+        size_t extent_offset = volume->file_desc_data_section_offset + ((size_t) (extent->first_cluster_number - 2) * volume->bytes_per_cluster);
+        size_t extent_size = (size_t) extent->cluster_count * volume->bytes_per_cluster;
+        if(extent_size > bytes_left) extent_size = bytes_left;
+
+        const uint8_t *extent_data = image_bytes(volume, extent_offset, extent_size);
+        if(extent_data == NULL) break;
+        content_hash_update(&hash, extent_data, extent_size);
+        bytes_left -= extent_size;
+    }
+    free_cluster_chain(&chain);
+
+    return content_hash_final(&hash);
+}
+
+// manifest: one record per file / directory, with a content hash for files. Files are hashed on the thread pool.
+typedef struct {
+    char *path;
+    const StandardDirectoryEntry *entry;
+    uint64_t hash;
+} ManifestEntry;
+
+typedef struct {
+    Fat12Volume *volume;
+    ManifestEntry *entries;
+    int entries_count;
+    int entries_capacity;
+} ManifestPlan;
+
+int collect_manifest_entry(Fat12Volume *volume, const char *path, const DirectoryItem *item, void *context) {
+    ManifestPlan *plan = (ManifestPlan *) context;
+    if(plan->entries_count == plan->entries_capacity) {
+        plan->entries_capacity = plan->entries_capacity > 0 ? 2 * plan->entries_capacity : 64;
+        plan->entries = (ManifestEntry *) realloc(plan->entries, sizeof(ManifestEntry) * plan->entries_capacity);
+    }
+    plan->entries[plan->entries_count++] = (ManifestEntry) { strdup(path), item->entry, 0 };
+    return 0;
+}
+
+void hash_manifest_entry(int job_index, void *context) {
+    ManifestPlan *plan = (ManifestPlan *) context;
+    ManifestEntry *entry = &plan->entries[job_index];
+    if(!(entry->entry->attribute & 0x10)) entry->hash = hash_file_data(plan->volume, entry->entry);
+}
+
+int manifest_volume(Fat12Volume *volume, OutputFormat format) {
+    ManifestPlan plan = { volume };
+    int status = walk_volume_tree(volume, collect_manifest_entry, &plan);
+    run_in_parallel(plan.entries_count, hash_manifest_entry, &plan);
+
+    for(int i = 0; i < plan.entries_count; i++) {
+        const ManifestEntry *entry = &plan.entries[i];
+        int is_directory = entry->entry->attribute & 0x10;
+        char attribute[7];
+        char modified[20];
+        char hash[17] = "-";
+        format_attribute(entry->entry->attribute, attribute);
+        format_fat_date_time(entry->entry->last_modified_date, entry->entry->last_modified_time, modified, sizeof(modified));
+        if(!is_directory) snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) entry->hash);
+
+        if(format == FORMAT_JSON) {
+            out_printf(volume->out, "{\"path\":");
+            out_json_string(volume->out, entry->path);
+            out_printf(volume->out, ",\"type\":\"%s\",\"size\":%u,\"attributes\":\"%s\",\"modified\":\"%s\",\"hash\":\"%s\"}\n",
+                    is_directory ? "directory" : "file", entry->entry->file_size_in_bytes, attribute, modified, hash);
+        } else {
+            out_printf(volume->out, "%16s %10u %s %s %s%s\n", hash, entry->entry->file_size_in_bytes, attribute, modified,
+                    entry->path, is_directory ? "/" : "");
+        }
+        free(entry->path);
+    }
+
+    free(plan.entries);
+    return status != 0;
+}
+
+// diff: what changed between two images. The directory trees are compared first. Content is only
+// looked at for files whose size and metadata match: with the same chain in both images, the clusters
+// are compared in place; with different chains, both files are hashed (on the thread pool).
+typedef enum {
+    CHANGE_NONE,
+    CHANGE_ADDED,
+    CHANGE_REMOVED,
+    CHANGE_CONTENT,
+    CHANGE_METADATA,
+} ChangeKind;
+
+typedef struct {
+    const char *path;
+    const StandardDirectoryEntry *before;
+    const StandardDirectoryEntry *after;
+    ChangeKind change;
+    int needs_hash;
+} DiffPair;
+
+typedef struct {
+    Fat12Volume *before;
+    Fat12Volume *after;
+    DiffPair *pairs;
+    int pairs_count;
+} DiffPlan;
+
+int compare_manifest_paths(const void *a, const void *b) {
+    return strcmp(((const ManifestEntry *) a)->path, ((const ManifestEntry *) b)->path);
+}
+
+int same_cluster_chains(const ClusterChain *a, const ClusterChain *b) {
+    if(a->extents_count != b->extents_count) return 0;
+    for(int i = 0; i < a->extents_count; i++) {
+        if(a->extents[i].first_cluster_number != b->extents[i].first_cluster_number ||
+           a->extents[i].cluster_count != b->extents[i].cluster_count) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int same_contents_in_place(Fat12Volume *before, Fat12Volume *after, const ClusterChain *chain, uint32_t size) {
+    // Both files sit in the same clusters, so it's a memcmp of each extent in both images.
+    uint32_t bytes_left = size;
+    for(int i = 0; i < chain->extents_count && bytes_left > 0; i++) {
+        const ClusterExtent *extent = &chain->extents[i];
+        size_t extent_size = (size_t) extent->cluster_count * before->bytes_per_cluster;
+        if(extent_size > bytes_left) extent_size = bytes_left;
+
+        size_t cluster_index = extent->first_cluster_number - 2;
+        const uint8_t *before_data = image_bytes(before, before->file_desc_data_section_offset + cluster_index * before->bytes_per_cluster, extent_size);
+        const uint8_t *after_data = image_bytes(after, after->file_desc_data_section_offset + cluster_index * after->bytes_per_cluster, extent_size);
+        if(before_data == NULL || after_data == NULL || memcmp(before_data, after_data, extent_size) != 0) return 0;
+        bytes_left -= extent_size;
+    }
+    return bytes_left == 0;
+}
+
+void hash_diff_pair(int job_index, void *context) {
+    DiffPlan *plan = (DiffPlan *) context;
+    DiffPair *pair = &plan->pairs[job_index];
+    if(!pair->needs_hash) return;
+
+    int is_same = hash_file_data(plan->before, pair->before) == hash_file_data(plan->after, pair->after);
+    if(!is_same) pair->change = CHANGE_CONTENT;
+}
+
+ChangeKind compare_entries(Fat12Volume *before, Fat12Volume *after, DiffPair *pair, int *compared_in_place) {
+    // Everything that can be decided without reading file contents. Sets needs_hash when it can't.
+    const StandardDirectoryEntry *a = pair->before;
+    const StandardDirectoryEntry *b = pair->after;
+    int is_metadata_same = a->attribute == b->attribute &&
+                           a->last_modified_date == b->last_modified_date && a->last_modified_time == b->last_modified_time &&
+                           a->created_date == b->created_date && a->created_time == b->created_time;
+
+    if((a->attribute & 0x10) != (b->attribute & 0x10) || a->file_size_in_bytes != b->file_size_in_bytes) return CHANGE_CONTENT;
+    ChangeKind unchanged_content = is_metadata_same ? CHANGE_NONE : CHANGE_METADATA;
+    if(a->attribute & 0x10) return unchanged_content;
+
+    ClusterChain chain_a, chain_b;
+    resolve_cluster_chain(before, a->first_cluster_number, &chain_a);
+    resolve_cluster_chain(after, b->first_cluster_number, &chain_b);
+
+    ChangeKind change = unchanged_content;
+    if(same_cluster_chains(&chain_a, &chain_b) && before->bytes_per_cluster == after->bytes_per_cluster) {
+        (*compared_in_place)++;
+        if(!same_contents_in_place(before, after, &chain_a, a->file_size_in_bytes)) change = CHANGE_CONTENT;
+    } else {
+        pair->needs_hash = 1;
+    }
+
+    free_cluster_chain(&chain_a);
+    free_cluster_chain(&chain_b);
+    return change;
+}
+
+int diff_volumes(Fat12Volume *before, Fat12Volume *after, OutputFormat format) {
+    // Prints one line per path that changed, sorted by path:
+    // "+" added, "-" removed, "M" contents changed, "m" only attributes / timestamps changed.
+    // Exits 0 if nothing changed, 1 if something did, 2 on errors, like diff.
+    ManifestPlan sides[2] = { { before }, { after } };
+    int status = walk_volume_tree(before, collect_manifest_entry, &sides[0]) |
+                 walk_volume_tree(after, collect_manifest_entry, &sides[1]);
+    qsort(sides[0].entries, sides[0].entries_count, sizeof(ManifestEntry), compare_manifest_paths);
+    qsort(sides[1].entries, sides[1].entries_count, sizeof(ManifestEntry), compare_manifest_paths);
+
+    int fat_entries_count = before->fat_table_entries_count > after->fat_table_entries_count ? before->fat_table_entries_count : after->fat_table_entries_count;
+    int fat_differences_count = 0;
+    for(int i = 2; i < fat_entries_count; i++) {
+        uint16_t a = i < before->fat_table_entries_count ? before->fat_table[i] : 0;
+        uint16_t b = i < after->fat_table_entries_count ? after->fat_table[i] : 0;
+        fat_differences_count += a != b;
+    }
+
+    // Merge the two sorted lists.
+    DiffPlan plan = { before, after };
+    plan.pairs = (DiffPair *) calloc(sides[0].entries_count + sides[1].entries_count + 1, sizeof(DiffPair));
+    int compared_in_place = 0;
+    int i = 0, j = 0;
+    while(i < sides[0].entries_count || j < sides[1].entries_count) {
+        int order = i == sides[0].entries_count ? 1 : j == sides[1].entries_count ? -1 : strcmp(sides[0].entries[i].path, sides[1].entries[j].path);
+        DiffPair *pair = &plan.pairs[plan.pairs_count++];
+
+        if(order < 0) {
+            *pair = (DiffPair) { sides[0].entries[i].path, sides[0].entries[i].entry, NULL, CHANGE_REMOVED, 0 };
+            i++;
+        } else if(order > 0) {
+            *pair = (DiffPair) { sides[1].entries[j].path, NULL, sides[1].entries[j].entry, CHANGE_ADDED, 0 };
+            j++;
+        } else {
+            *pair = (DiffPair) { sides[0].entries[i].path, sides[0].entries[i].entry, sides[1].entries[j].entry, CHANGE_NONE, 0 };
+            pair->change = compare_entries(before, after, pair, &compared_in_place);
+            i++;
+            j++;
+        }
+    }
+
+    int hashed_count = 0;
+    for(int k = 0; k < plan.pairs_count; k++) hashed_count += plan.pairs[k].needs_hash;
+    run_in_parallel(plan.pairs_count, hash_diff_pair, &plan);
+
+    int counts[5] = { 0 };
+    const char *markers[5] = { " ", "+", "-", "M", "m" };
+    const char *names[5] = { "none", "added", "removed", "content", "metadata" };
+    for(int k = 0; k < plan.pairs_count; k++) {
+        const DiffPair *pair = &plan.pairs[k];
+        counts[pair->change]++;
+        if(pair->change == CHANGE_NONE) continue;
+
+        int is_directory = ((pair->after != NULL ? pair->after : pair->before)->attribute & 0x10) != 0;
+        if(format == FORMAT_JSON) {
+            out_printf(before->out, "{\"path\":");
+            out_json_string(before->out, pair->path);
+            out_printf(before->out, ",\"change\":\"%s\",\"type\":\"%s\"}\n", names[pair->change], is_directory ? "directory" : "file");
+        } else {
+            out_printf(before->out, "%s %s%s\n", markers[pair->change], pair->path, is_directory ? "/" : "");
+        }
+    }
+
+    if(format != FORMAT_JSON) {
+        out_printf(before->out, "%d added, %d removed, %d changed, %d metadata only, %d unchanged. "
+                "%d FAT entries differ, %d files compared in place, %d hashed\n",
+                counts[CHANGE_ADDED], counts[CHANGE_REMOVED], counts[CHANGE_CONTENT], counts[CHANGE_METADATA], counts[CHANGE_NONE],
+                fat_differences_count, compared_in_place, hashed_count);
+    }
+
+    for(int side = 0; side < 2; side++) {
+        for(int k = 0; k < sides[side].entries_count; k++) free(sides[side].entries[k].path);
+        free(sides[side].entries);
+    }
+    free(plan.pairs);
+
+    if(status != 0) return 2;
+    return counts[CHANGE_NONE] == plan.pairs_count ? 0 : 1;
+}
+
+// Health check, fsck-style. Everything is done in linear passes over the FAT and the tree:
+// every cluster is claimed by at most one chain walk, so the cost is O(clusters), not O(files x chain length).
+typedef struct {
+    char path[PATH_MAX];
+    int clusters_count;
+    int fragments_count;
+    int is_cross_linked;
+    int is_looped;
+    int is_size_mismatched;
+} AnalyzedFile;
+
+typedef struct {
+    // owner[cluster] is the 1-based index of the file / directory whose chain claimed it, 0 if none.
+    int *owner;
+    // How many FAT entries point at each cluster. A chain head has 0.
+    uint16_t *reference_count;
+
+    AnalyzedFile *files;
+    int files_count;
+    int files_capacity;
+
+    int cross_linked_count;
+    int looped_count;
+    int size_mismatched_count;
+} VolumeAnalysis;
+
+void claim_chain(Fat12Volume *volume, VolumeAnalysis *analysis, AnalyzedFile *file, int file_number, int first_cluster_number) {
+    // Walk the chain, marking each cluster as owned by this file.
+    // Hitting one of its own clusters again is a loop, hitting someone else's is a cross-link.
+    // Either way the walk stops there, so no cluster is walked twice.
+    int previous_cluster_number = -1;
+    int cluster_number = first_cluster_number;
+
+    while(is_chain_link(cluster_number) && cluster_number < volume->fat_table_entries_count) {
+        if(analysis->owner[cluster_number] == file_number) {
+            file->is_looped = 1;
+            break;
+        }
+        if(analysis->owner[cluster_number] != 0) {
+            file->is_cross_linked = 1;
+
+            // Both chains share the cluster, so both are cross-linked.
+            int other_file_number = analysis->owner[cluster_number];
+            if(file_number > 0 && other_file_number > 0 && !analysis->files[other_file_number - 1].is_cross_linked) {
+                analysis->files[other_file_number - 1].is_cross_linked = 1;
+                analysis->cross_linked_count++;
+            }
+            break;
+        }
+
+        analysis->owner[cluster_number] = file_number;
+        file->clusters_count++;
+        if(cluster_number != previous_cluster_number + 1) file->fragments_count++;
+
+        previous_cluster_number = cluster_number;
+        cluster_number = volume->fat_table[cluster_number];
+    }
+}
+
+int analyze_entry(Fat12Volume *volume, const char *path, const DirectoryItem *item, void *context) {
+    VolumeAnalysis *analysis = (VolumeAnalysis *) context;
+
+    if(analysis->files_count == analysis->files_capacity) {
+        analysis->files_capacity = analysis->files_capacity > 0 ? 2 * analysis->files_capacity : 64;
+        analysis->files = (AnalyzedFile *) realloc(analysis->files, sizeof(AnalyzedFile) * analysis->files_capacity);
+    }
+    AnalyzedFile *file = &analysis->files[analysis->files_count++];
+    memset(file, 0, sizeof(AnalyzedFile));
+    snprintf(file->path, PATH_MAX, "%s%s", path, (item->entry->attribute & 0x10) ? "/" : "");
+
+    claim_chain(volume, analysis, file, analysis->files_count, item->entry->first_cluster_number);
+
+    // A file needs exactly enough clusters for its size. Directories have size 0, so they're skipped.
+    if(!(item->entry->attribute & 0x10)) {
+        int clusters_needed = (item->entry->file_size_in_bytes + volume->bytes_per_cluster - 1) / volume->bytes_per_cluster;
+        file->is_size_mismatched = !file->is_looped && !file->is_cross_linked && clusters_needed != file->clusters_count;
+    }
+
+    analysis->cross_linked_count += file->is_cross_linked;
+    analysis->looped_count += file->is_looped;
+    analysis->size_mismatched_count += file->is_size_mismatched;
+
+    // A looped directory chain would make the tree walk go round in circles.
+    return file->is_looped;
+}
+
+int analyze_volume(Fat12Volume *volume, OutputFormat format) {
+    int clusters_count = volume->fat_table_entries_count;
+    VolumeAnalysis analysis = { 0 };
+    analysis.owner = (int *) calloc(clusters_count > 0 ? clusters_count : 1, sizeof(int));
+    analysis.reference_count = (uint16_t *) calloc(clusters_count > 0 ? clusters_count : 1, sizeof(uint16_t));
+
+    // Pass 1, over the FAT: free space, bad clusters, and how often each cluster is pointed at.
+    int free_clusters = 0;
+    int bad_clusters = 0;
+    int largest_free_run = 0;
+    int largest_free_run_start = 0;
+    int current_free_run = 0;
+    for(int i = 2; i < clusters_count; i++) {
+        uint16_t table_value = volume->fat_table[i];
+
+        if(table_value == 0) {
+            free_clusters++;
+            if(++current_free_run > largest_free_run) {
+                largest_free_run = current_free_run;
+                largest_free_run_start = i - current_free_run + 1;
+            }
+            continue;
+        }
+        current_free_run = 0;
+
+        if(table_value == 0xFF7) bad_clusters++;
+        if(is_chain_link(table_value) && table_value < clusters_count) analysis.reference_count[table_value]++;
+    }
+
+    // Pass 2, over the tree: claim every file / directory chain.
+    int status = walk_volume_tree(volume, analyze_entry, &analysis);
+
+    // Pass 3, over the FAT again: allocated clusters nobody claimed are lost.
+    // Every lost chain starts at a lost cluster nothing points at, except chains that are pure loops.
+    int lost_clusters = 0;
+    int lost_chains = 0;
+    AnalyzedFile lost_file;
+    for(int i = 2; i < clusters_count; i++) {
+        uint16_t table_value = volume->fat_table[i];
+        if(table_value == 0 || table_value == 0xFF7 || analysis.owner[i] != 0) continue;
+
+        lost_clusters++;
+        if(analysis.reference_count[i] == 0) {
+            lost_chains++;
+            memset(&lost_file, 0, sizeof(lost_file));
+            claim_chain(volume, &analysis, &lost_file, -1, i);
+        }
+    }
+    for(int i = 2; i < clusters_count; i++) {
+        uint16_t table_value = volume->fat_table[i];
+        if(table_value == 0 || table_value == 0xFF7 || analysis.owner[i] != 0) continue;
+
+        // Still unclaimed after walking from every head, so it's on a loop with no way in.
+        lost_chains++;
+        memset(&lost_file, 0, sizeof(lost_file));
+        claim_chain(volume, &analysis, &lost_file, -1, i);
+    }
+
+    // FAT copies should all be identical.
+    int fat_size_in_bytes = volume->boot_record->sectors_per_fat * volume->boot_record->bytes_per_sector;
+    const uint8_t *first_fat = image_bytes(volume, volume->file_desc_fat_section_offset, fat_size_in_bytes);
+    int mismatched_fat_copies = 0;
+    for(int copy = 1; copy < volume->boot_record->fat_count; copy++) {
+        const uint8_t *fat_copy = image_bytes(volume, volume->file_desc_fat_section_offset + (size_t) copy * fat_size_in_bytes, fat_size_in_bytes);
+        if(fat_copy == NULL || memcmp(first_fat, fat_copy, fat_size_in_bytes) != 0) mismatched_fat_copies++;
+    }
+
+    int fragmented_files = 0;
+    int total_fragments = 0;
+    for(int i = 0; i < analysis.files_count; i++) {
+        total_fragments += analysis.files[i].fragments_count;
+        if(analysis.files[i].fragments_count > 1) fragmented_files++;
+    }
+
+    int problems_count = analysis.cross_linked_count + analysis.looped_count + analysis.size_mismatched_count +
+                         lost_chains + mismatched_fat_copies;
+
+    if(format == FORMAT_JSON) {
+        out_printf(volume->out, "{\"clusters\":%d,\"free_clusters\":%d,\"bad_clusters\":%d,"
+                "\"largest_free_run\":%d,\"largest_free_run_start\":%d,"
+                "\"entries\":%d,\"fragmented_entries\":%d,\"fragments\":%d,"
+                "\"cross_linked\":%d,\"looped\":%d,\"size_mismatched\":%d,"
+                "\"lost_clusters\":%d,\"lost_chains\":%d,\"mismatched_fat_copies\":%d,\"files\":[",
+                clusters_count - 2, free_clusters, bad_clusters, largest_free_run, largest_free_run_start,
+                analysis.files_count, fragmented_files, total_fragments,
+                analysis.cross_linked_count, analysis.looped_count, analysis.size_mismatched_count,
+                lost_clusters, lost_chains, mismatched_fat_copies);
+        for(int i = 0; i < analysis.files_count; i++) {
+            const AnalyzedFile *file = &analysis.files[i];
+            out_printf(volume->out, "%s{\"path\":", i > 0 ? "," : "");
+            out_json_string(volume->out, file->path);
+            out_printf(volume->out, ",\"clusters\":%d,\"fragments\":%d,\"cross_linked\":%s,\"looped\":%s,\"size_mismatched\":%s}",
+                    file->clusters_count, file->fragments_count,
+                    file->is_cross_linked ? "true" : "false", file->is_looped ? "true" : "false",
+                    file->is_size_mismatched ? "true" : "false");
+        }
+        out_printf(volume->out, "]}\n");
+    } else {
+        out_printf(volume->out, "Clusters            : %d\n", clusters_count - 2);
+        out_printf(volume->out, "Free Clusters       : %d\n", free_clusters);
+        out_printf(volume->out, "Bad Clusters        : %d\n", bad_clusters);
+        out_printf(volume->out, "Largest Free Run    : %d clusters, starting at %d\n", largest_free_run, largest_free_run_start);
+        out_printf(volume->out, "Entries             : %d (%d fragmented, %d fragments)\n", analysis.files_count, fragmented_files, total_fragments);
+        out_printf(volume->out, "Cross-linked Chains : %d\n", analysis.cross_linked_count);
+        out_printf(volume->out, "Looped Chains       : %d\n", analysis.looped_count);
+        out_printf(volume->out, "Size Mismatches     : %d\n", analysis.size_mismatched_count);
+        out_printf(volume->out, "Lost Clusters       : %d in %d chains\n", lost_clusters, lost_chains);
+        out_printf(volume->out, "Mismatched FATs     : %d\n", mismatched_fat_copies);
+
+        for(int i = 0; i < analysis.files_count; i++) {
+            const AnalyzedFile *file = &analysis.files[i];
+            if(file->fragments_count <= 1 && !file->is_cross_linked && !file->is_looped && !file->is_size_mismatched) continue;
+
+            out_printf(volume->out, "  %s: %d clusters in %d fragments%s%s%s\n", file->path,
+                    file->clusters_count, file->fragments_count,
+                    file->is_cross_linked ? ", cross-linked" : "",
+                    file->is_looped ? ", loops" : "",
+                    file->is_size_mismatched ? ", size doesn't match chain" : "");
+        }
+    }
+
+    free(analysis.owner);
+    free(analysis.reference_count);
+    free(analysis.files);
+
+    // Non-zero exit if anything is wrong, so scripts can just check the status.
+    return status != 0 || problems_count > 0;
+}
+
+void close_disk_img(Fat12Volume *volume) {
+    // Forgot that closing a file is a thing
+    if(volume->image.data != NULL) {
+        if(volume->image.is_mapped) {
+            munmap((void *) volume->image.data, volume->image.size);
+        } else {
+            free((void *) volume->image.data);
+        }
+    }
+    if(volume->image.fd >= 0) close(volume->image.fd);
+    volume->image = (ImageMapping) { -1, NULL, 0, 0 };
+
+    free(volume->fat_table);
+    volume->fat_table = NULL;
+    free(volume->dirty_sectors);
+    volume->dirty_sectors = NULL;
+}
+
+int load_volume(Fat12Volume *volume, unsigned char *image_path) {
+    // Everything every command needs: the mapping, the boot record, and the unpacked FAT.
+    if(open_disk_img(volume, image_path) != 0 ||
+       read_boot_drive_section(volume) != 0 ||
+       read_file_allocation_table_section(volume) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Write support: put, mkdir, rm and import.
+// The image is read into the heap once, and every change is made to that copy. The copy is the
+// write-back cache: changed sectors are marked dirty, and flush_volume() writes them back in a few
+// large pwrite() calls at the end. Nothing is written at all unless every operation worked.
+
+int open_disk_img_for_writing(Fat12Volume *volume, unsigned char *image_path) {
+    volume->image_path = (const char *) image_path;
+    volume->image.fd = open((const char *) image_path, O_RDWR);
+    if(volume->image.fd < 0) {
+        fprintf(stderr, "Error: Could not open image file %s for writing\n", image_path);
+        return -1;
+    }
+
+    struct stat image_stat;
+    if(fstat(volume->image.fd, &image_stat) != 0 || !S_ISREG(image_stat.st_mode)) {
+        fprintf(stderr, "Error: %s: Only regular files can be written to\n", image_path);
+        return -1;
+    }
+    volume->image.size = image_stat.st_size;
+
+    if(read_whole_image_into_heap(volume) != 0) {
+        fprintf(stderr, "Error: Could not read image file %s\n", image_path);
+        return -1;
+    }
+    return 0;
+}
+
+int load_volume_for_writing(Fat12Volume *volume, unsigned char *image_path) {
+    if(open_disk_img_for_writing(volume, image_path) != 0 ||
+       read_boot_drive_section(volume) != 0 ||
+       read_file_allocation_table_section(volume) != 0) {
+        return -1;
+    }
+
+    int bytes_per_sector = volume->boot_record->bytes_per_sector;
+    volume->sectors_count = (volume->image.size + bytes_per_sector - 1) / bytes_per_sector;
+    volume->dirty_sectors = (uint8_t *) calloc(volume->sectors_count, 1);
+    return volume->dirty_sectors != NULL ? 0 : -1;
+}
+
+uint8_t *writable_bytes(Fat12Volume *volume, size_t offset, size_t length) {
+    // Same as image_bytes(), but the pointer may be written to. Every sector it covers is marked dirty.
+    if(volume->dirty_sectors == NULL || image_bytes(volume, offset, length) == NULL) {
+        return NULL;
+    }
+
+    size_t bytes_per_sector = volume->boot_record->bytes_per_sector;
+    for(size_t sector = offset / bytes_per_sector; sector * bytes_per_sector < offset + length; sector++) {
+        volume->dirty_sectors[sector] = 1;
+    }
+    return (uint8_t *) volume->image.data + offset;
+}
+
+size_t cluster_offset(Fat12Volume *volume, int cluster_number) {
+    return volume->file_desc_data_section_offset + ((size_t) (cluster_number - 2) * volume->bytes_per_cluster);
+}
+
+void set_fat_entry(Fat12Volume *volume, int cluster_number, uint16_t table_value) {
+    // Only the unpacked table changes here. flush_volume() packs it back into every FAT copy.
+    volume->fat_table[cluster_number] = table_value;
+    volume->is_fat_dirty = 1;
+}
+
+int allocate_clusters(Fat12Volume *volume, int clusters_count, int previous_cluster_number, ClusterChain *allocated) {
+    // Finds clusters_count free clusters and links them into a chain.
+    // If previous_cluster_number is a cluster, the new clusters are linked on after it (to grow a directory).
+    // Files should stay in one piece, so this takes the smallest free run that fits everything.
+    // Only if no run is big enough, the biggest run is used and the rest goes into the next one.
+    *allocated = (ClusterChain) { 0 };
+
+    int free_count = 0;
+    for(int cluster_number = 2; cluster_number < volume->fat_table_entries_count; cluster_number++) {
+        free_count += volume->fat_table[cluster_number] == 0;
+    }
+    if(free_count < clusters_count) return -1;
+
+    // Clusters are marked as end of chain as soon as they're taken, so the next search skips them.
+    int remaining = clusters_count;
+    if(previous_cluster_number >= 2) {
+        for(int cluster_number = previous_cluster_number + 1;
+            remaining > 0 && cluster_number < volume->fat_table_entries_count && volume->fat_table[cluster_number] == 0;
+            cluster_number++, remaining--) {
+            append_cluster_to_chain(allocated, cluster_number);
+            volume->fat_table[cluster_number] = 0xFFF;
+        }
+    }
+
+    while(remaining > 0) {
+        int best_start = 0, best_length = 0;
+        int biggest_start = 0, biggest_length = 0;
+
+        for(int cluster_number = 2; cluster_number < volume->fat_table_entries_count; ) {
+            if(volume->fat_table[cluster_number] != 0) {
+                cluster_number++;
+                continue;
+            }
+
+            int start = cluster_number;
+            while(cluster_number < volume->fat_table_entries_count && volume->fat_table[cluster_number] == 0) cluster_number++;
+            int length = cluster_number - start;
+
+            if(length >= remaining && (best_length == 0 || length < best_length)) {
+                best_start = start;
+                best_length = length;
+            }
+            if(length > biggest_length) {
+                biggest_start = start;
+                biggest_length = length;
+            }
+        }
+
+        int start = best_length > 0 ? best_start : biggest_start;
+        int take = best_length > 0 ? remaining : biggest_length;
+        for(int i = 0; i < take; i++) {
+            append_cluster_to_chain(allocated, start + i);
+            volume->fat_table[start + i] = 0xFFF;
+        }
+        remaining -= take;
+    }
+
+    int previous = previous_cluster_number;
+    for(int i = 0; i < allocated->extents_count; i++) {
+        const ClusterExtent *extent = &allocated->extents[i];
+        for(int cluster_number = extent->first_cluster_number; cluster_number < extent->first_cluster_number + extent->cluster_count; cluster_number++) {
+            if(previous >= 2) set_fat_entry(volume, previous, cluster_number);
+            previous = cluster_number;
+        }
+    }
+    set_fat_entry(volume, previous, 0xFFF);
+    return 0;
+}
+
+void release_cluster_chain(Fat12Volume *volume, int first_cluster_number) {
+    ClusterChain chain;
+    resolve_cluster_chain(volume, first_cluster_number, &chain);
+
+    for(int i = 0; i < chain.extents_count; i++) {
+        const ClusterExtent *extent = &chain.extents[i];
+        for(int cluster_number = extent->first_cluster_number; cluster_number < extent->first_cluster_number + extent->cluster_count; cluster_number++) {
+            set_fat_entry(volume, cluster_number, 0);
+        }
+    }
+    free_cluster_chain(&chain);
+}
+
+void pack_fat12_entries(const uint16_t *entries, int entries_count, uint8_t *packed) {
+    // The other way around from unpack_fat12_entries(). Bytes past the last entry are left alone.
+    for(int i = 0; i < entries_count; i++) {
+        int fat12_table_index = i + (i / 2);
+        uint16_t table_value = entries[i] & 0xFFF;
+
+        if(i % 2 == 1) {
+            packed[fat12_table_index] = (packed[fat12_table_index] & 0x0F) | ((table_value & 0x0F) << 4);
+            packed[fat12_table_index + 1] = table_value >> 4;
+        } else {
+            packed[fat12_table_index] = table_value & 0xFF;
+            packed[fat12_table_index + 1] = (packed[fat12_table_index + 1] & 0xF0) | (table_value >> 8);
+        }
+    }
+}
+
+int pwrite_all(int fd, const uint8_t *data, size_t size, off_t offset) {
+    while(size > 0) {
+        ssize_t bytes_written = pwrite(fd, data, size, offset);
+        if(bytes_written < 0 && errno == EINTR) continue;
+        if(bytes_written <= 0) return -1;
+        data += bytes_written;
+        size -= bytes_written;
+        offset += bytes_written;
+    }
+    return 0;
+}
+
+// Clean sectors between two dirty runs are written too, if there are only a few of them.
+// Rewriting a few unchanged sectors is cheaper than another system call.
+#define FLUSH_GAP_SECTORS 8
+
+void sync_fat_copies(Fat12Volume *volume) {
+    // Every FAT copy gets the same table, so the copies never disagree after a write.
+    // Only the sectors that actually change are marked dirty.
+    int bytes_per_sector = volume->boot_record->bytes_per_sector;
+
+    if(volume->is_fat_dirty) {
+        int fat_size_in_bytes = volume->boot_record->sectors_per_fat * bytes_per_sector;
+        uint8_t *packed_fat = (uint8_t *) malloc(fat_size_in_bytes);
+
+        for(int fat_index = 0; packed_fat != NULL && fat_index < volume->boot_record->fat_count; fat_index++) {
+            size_t fat_offset = volume->file_desc_fat_section_offset + (size_t) fat_index * fat_size_in_bytes;
+            const uint8_t *current_fat = image_bytes(volume, fat_offset, fat_size_in_bytes);
+            if(current_fat == NULL) break;
+
+            memcpy(packed_fat, current_fat, fat_size_in_bytes);
+            pack_fat12_entries(volume->fat_table, volume->fat_table_entries_count, packed_fat);
+
+            for(int sector_offset = 0; sector_offset < fat_size_in_bytes; sector_offset += bytes_per_sector) {
+                if(memcmp(packed_fat + sector_offset, current_fat + sector_offset, bytes_per_sector) != 0) {
+                    memcpy(writable_bytes(volume, fat_offset + sector_offset, bytes_per_sector), packed_fat + sector_offset, bytes_per_sector);
+                }
+            }
+        }
+        free(packed_fat);
+        volume->is_fat_dirty = 0;
+    }
+}
+
+int flush_volume(Fat12Volume *volume) {
+    int bytes_per_sector = volume->boot_record->bytes_per_sector;
+    sync_fat_copies(volume);
+
+    int sectors_written = 0;
+    int writes_count = 0;
+    for(int sector = 0; sector < volume->sectors_count; ) {
+        if(!volume->dirty_sectors[sector]) {
+            sector++;
+            continue;
+        }
+
+        int run_end = sector + 1;
+        while(1) {
+            while(run_end < volume->sectors_count && volume->dirty_sectors[run_end]) run_end++;
+
+            int next_dirty = run_end;
+            while(next_dirty < volume->sectors_count && next_dirty - run_end < FLUSH_GAP_SECTORS && !volume->dirty_sectors[next_dirty]) next_dirty++;
+            if(next_dirty >= volume->sectors_count || !volume->dirty_sectors[next_dirty]) break;
+            run_end = next_dirty;
+        }
+
+        size_t offset = (size_t) sector * bytes_per_sector;
+        size_t end = (size_t) run_end * bytes_per_sector;
+        if(end > volume->image.size) end = volume->image.size;
+
+        if(pwrite_all(volume->image.fd, volume->image.data + offset, end - offset, offset) != 0) {
+            fprintf(stderr, "Error: %s: Could not write to image: %s\n", volume->image_path, strerror(errno));
+            return -1;
+        }
+        STATS_ADD(volume, write_calls, 1);
+        STATS_ADD(volume, bytes_written, end - offset);
+        sectors_written += run_end - sector;
+        writes_count++;
+        sector = run_end;
+    }
+
+    memset(volume->dirty_sectors, 0, volume->sectors_count);
+    out_printf(volume->out, "Wrote %d sectors in %d writes\n", sectors_written, writes_count);
+    return 0;
+}
+
+void tm_to_fat_date_time(const struct tm *when, uint16_t *date, uint16_t *time) {
+    // FAT dates can only hold 1980 to 2107.
+    if(when->tm_year < 80) {
+        *date = (1 << 5) | 1;
+        *time = 0;
+    } else if(when->tm_year > 207) {
+        *date = (127 << 9) | (12 << 5) | 31;
+        *time = (23 << 11) | (59 << 5) | 29;
+    } else {
+        *date = ((when->tm_year - 80) << 9) | ((when->tm_mon + 1) << 5) | when->tm_mday;
+        *time = (when->tm_hour << 11) | (when->tm_min << 5) | (when->tm_sec / 2);
+    }
+}
+
+void time_to_fat_date_time(time_t when, uint16_t *date, uint16_t *time) {
+    struct tm local;
+    localtime_r(&when, &local);
+    tm_to_fat_date_time(&local, date, time);
+}
+
+void fill_directory_entry(Fat12Volume *volume, StandardDirectoryEntry *entry, const uint8_t *short_name, uint8_t attribute, int first_cluster_number, uint32_t size, time_t modified) {
+    memset(entry, 0, sizeof(StandardDirectoryEntry));
+    memcpy(entry->file_name, short_name, 11);
+    entry->attribute = attribute;
+    uint16_t date = volume->fixed_date, time = volume->fixed_time;
+    if(!volume->has_fixed_timestamp) time_to_fat_date_time(modified, &date, &time);
+    entry->created_date = entry->last_modified_date = entry->last_accessed_date = date;
+    entry->created_time = entry->last_modified_time = time;
+    entry->first_cluster_number = first_cluster_number;
+    entry->file_size_in_bytes = size;
+}
+
+int utf8_to_utf16(const char *name, uint16_t *units, int max_units) {
+    // LFN entries hold UTF-16. Returns the number of code units, or -1 for broken UTF-8 or a name that's too long.
+    const unsigned char *c = (const unsigned char *) name;
+    int units_count = 0;
+
+    while(*c != '\0') {
+        uint32_t code_point;
+        int continuation_bytes;
+        if(*c < 0x80)                { code_point = *c;        continuation_bytes = 0; }
+        else if((*c & 0xE0) == 0xC0) { code_point = *c & 0x1F; continuation_bytes = 1; }
+        else if((*c & 0xF0) == 0xE0) { code_point = *c & 0x0F; continuation_bytes = 2; }
+        else if((*c & 0xF8) == 0xF0) { code_point = *c & 0x07; continuation_bytes = 3; }
+        else return -1;
+        c++;
+
+        for(int i = 0; i < continuation_bytes; i++, c++) {
+            if((*c & 0xC0) != 0x80) return -1;
+            code_point = (code_point << 6) | (*c & 0x3F);
+        }
+
+        if(code_point >= 0x10000) {
+            // Outside the BMP. Needs a surrogate pair.
+            if(code_point > 0x10FFFF || units_count + 2 > max_units) return -1;
+            code_point -= 0x10000;
+            units[units_count++] = 0xD800 | (code_point >> 10);
+            units[units_count++] = 0xDC00 | (code_point & 0x3FF);
+        } else {
+            if(units_count + 1 > max_units) return -1;
+            units[units_count++] = code_point;
+        }
+    }
+    return units_count;
+}
+
+char short_name_char(unsigned char c, int *is_lossy, int *letter_cases) {
+    // Returns the char to put in the 8.3 name, or 0 to drop it.
+    // Anything that's dropped or replaced means the real name has to go into LFN entries.
+    // Lower case letters just become upper case. letter_cases gets 1 for upper case and 2 for lower case.
+    if('A' <= c && c <= 'Z') *letter_cases |= 1;
+    if(('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') || (c != '\0' && strchr("!#$%&'()-@^_`{}~", c) != NULL)) {
+        return (char) c;
+    }
+    if('a' <= c && c <= 'z') {
+        *letter_cases |= 2;
+        return (char) (c - ('a' - 'A'));
+    }
+
+    *is_lossy = 1;
+    if(c == ' ' || c == '.') return 0;
+    if((c & 0xC0) == 0x80) return 0; // Rest of a UTF-8 char. Its first byte already became '_'.
+    return '_';
+}
+
+int is_short_name_taken(const uint8_t *short_names, int short_names_count, const uint8_t *short_name) {
+    for(int i = 0; i < short_names_count; i++) {
+        if(memcmp(short_names + 11 * i, short_name, 11) == 0) return 1;
+    }
+    return 0;
+}
+
+int make_short_name(Fat12Volume *volume, int directory_cluster, const char *name, uint8_t *short_name, uint8_t *case_flags) {
+    // Returns 0 if name fits in an 8.3 name, and needs no LFN entries. An all lower case name or extension
+    // gets its flag in case_flags, like "lore1.txt" -> "LORE1   TXT" + 0x18. Returns 1 if it needs LFN entries.
+    // Mixed case like "Lore.txt" only needs them to keep the case, so the 8.3 name stays "LORE    TXT".
+    // Only a name that was cut short or had chars replaced (or one that's taken) gets a "~N" tail,
+    // one that no other entry in the directory has.
+    // Returns -1 for names FAT can't store at all.
+    for(const unsigned char *c = (const unsigned char *) name; *c != '\0'; c++) {
+        if(*c < 0x20 || strchr("\"*/:<>?\\|", *c) != NULL) return -1;
+    }
+
+    // The extension is whatever follows the last dot. A leading dot doesn't start an extension.
+    const char *extension = strrchr(name, '.');
+    if(extension == name) extension = NULL;
+
+    int is_lossy = 0;
+    int base_cases = 0, ext_cases = 0;
+    char base[8], ext[3];
+    int base_length = 0, ext_length = 0;
+    for(const char *c = name; *c != '\0' && c != extension; c++) {
+        char converted = short_name_char((unsigned char) *c, &is_lossy, &base_cases);
+        if(converted == 0) continue;
+        if(base_length == 8) is_lossy = 1;
+        else base[base_length++] = converted;
+    }
+    for(const char *c = extension != NULL ? extension + 1 : ""; *c != '\0'; c++) {
+        char converted = short_name_char((unsigned char) *c, &is_lossy, &ext_cases);
+        if(converted == 0) continue;
+        if(ext_length == 3) is_lossy = 1;
+        else ext[ext_length++] = converted;
+    }
+    if(base_length == 0) {
+        base[base_length++] = '_';
+        is_lossy = 1;
+    }
+
+    // Every 8.3 name that's already in the directory.
+    int short_names_count = 0;
+    int short_names_capacity = 16;
+    uint8_t *short_names = (uint8_t *) malloc(11 * short_names_capacity);
+
+    DirectoryIterator iterator;
+    DirectoryItem item;
+    open_directory(volume, &iterator, directory_cluster);
+    while(short_names != NULL && next_directory_item(&iterator, &item)) {
+        if(short_names_count == short_names_capacity) {
+            short_names_capacity *= 2;
+            uint8_t *grown = (uint8_t *) realloc(short_names, 11 * short_names_capacity);
+            if(grown == NULL) {
+                free(short_names);
+                short_names = NULL;
+                break;
+            }
+            short_names = grown;
+        }
+        memcpy(short_names + 11 * short_names_count++, item.entry->file_name, 11);
+    }
+    close_directory(&iterator);
+    if(short_names == NULL) return -1;
+
+    memset(short_name, ' ', 11);
+    memcpy(short_name, base, base_length);
+    memcpy(short_name + 8, ext, ext_length);
+
+    int status = -1;
+    *case_flags = 0;
+    if(!is_lossy && !is_short_name_taken(short_names, short_names_count, short_name)) {
+        if(base_cases == 3 || ext_cases == 3) {
+            status = 1;
+        } else {
+            status = 0;
+            *case_flags = (base_cases == 2 ? 0x08 : 0) | (ext_cases == 2 ? 0x10 : 0);
+        }
+    } else {
+        for(int tail_number = 1; tail_number < 1000000; tail_number++) {
+            char tail[8];
+            int tail_length = snprintf(tail, sizeof(tail), "~%d", tail_number);
+            int kept_length = base_length < 8 - tail_length ? base_length : 8 - tail_length;
+
+            memset(short_name, ' ', 8);
+            memcpy(short_name, base, kept_length);
+            memcpy(short_name + kept_length, tail, tail_length);
+            if(!is_short_name_taken(short_names, short_names_count, short_name)) {
+                status = 1;
+                break;
+            }
+        }
+    }
+
+    free(short_names);
+    return status;
+}
+
+size_t find_free_slots_in_run(Fat12Volume *volume, size_t offset, int slots_count, int slots_needed, int *is_past_end) {
+    // Looks for slots_needed free slots in a row. Free means deleted (0xE5), or anywhere after the
+    // 0x00 end of directory marker. Returns the offset of the first one, or 0 if there's no such run.
+    const uint8_t *slots = image_bytes(volume, offset, (size_t) slots_count * sizeof(RootDirectoryEntry));
+    if(slots == NULL) return 0;
+
+    int run_start = 0;
+    int run_length = 0;
+    for(int i = 0; i < slots_count; i++) {
+        uint8_t first_byte = slots[i * sizeof(RootDirectoryEntry)];
+        if(first_byte == 0x00) *is_past_end = 1;
+
+        if(!*is_past_end && first_byte != 0xE5) {
+            run_length = 0;
+            continue;
+        }
+        if(run_length++ == 0) run_start = i;
+        if(run_length < slots_needed) continue;
+
+        // Slots after the end marker might hold leftovers. Keep the one after the new entries an end marker.
+        if(*is_past_end && i + 1 < slots_count && slots[(i + 1) * sizeof(RootDirectoryEntry)] != 0x00) {
+            writable_bytes(volume, offset + (i + 1) * sizeof(RootDirectoryEntry), 1)[0] = 0x00;
+        }
+        return offset + run_start * sizeof(RootDirectoryEntry);
+    }
+    return 0;
+}
+
+size_t grow_directory(Fat12Volume *volume, const ClusterChain *chain, int clusters_needed) {
+    // Links clusters_needed empty clusters on to the end of a directory.
+    // Returns the offset of the first new one, or 0 if there's no space.
+    if(chain->extents_count == 0 || chain->is_looped) return 0;
+
+    const ClusterExtent *last_extent = &chain->extents[chain->extents_count - 1];
+    int last_cluster_number = last_extent->first_cluster_number + last_extent->cluster_count - 1;
+
+    ClusterChain grown;
+    if(allocate_clusters(volume, clusters_needed, last_cluster_number, &grown) != 0) return 0;
+
+    // New directory clusters have to start out empty, or leftovers would show up as entries.
+    for(int i = 0; i < grown.extents_count; i++) {
+        size_t extent_size = (size_t) grown.extents[i].cluster_count * volume->bytes_per_cluster;
+        uint8_t *extent_data = writable_bytes(volume, cluster_offset(volume, grown.extents[i].first_cluster_number), extent_size);
+        if(extent_data != NULL) memset(extent_data, 0, extent_size);
+    }
+    size_t first_offset = cluster_offset(volume, grown.extents[0].first_cluster_number);
+    free_cluster_chain(&grown);
+    return first_offset;
+}
+
+size_t find_free_slots_in_chain(Fat12Volume *volume, const ClusterChain *chain, int slots_needed) {
+    // LFN runs can't cross from one extent into the next, so every extent is searched on its own.
+    int is_past_end = 0;
+    int end_extent_index = -1;
+    for(int i = 0; i < chain->extents_count; i++) {
+        const ClusterExtent *extent = &chain->extents[i];
+        size_t extent_offset = cluster_offset(volume, extent->first_cluster_number);
+        int slots_count = volume->directory_entries_per_cluster * extent->cluster_count;
+
+        size_t found_offset = find_free_slots_in_run(volume, extent_offset, slots_count, slots_needed, &is_past_end);
+        if(is_past_end && end_extent_index < 0) end_extent_index = i;
+        if(found_offset == 0) continue;
+
+        // The end marker was in an earlier extent, and the reader stops there. Everything from it up to
+        // this extent is free anyway, so it's marked deleted instead, and the new entries can be seen.
+        for(int j = end_extent_index; j >= 0 && j < i; j++) {
+            size_t skipped_offset = cluster_offset(volume, chain->extents[j].first_cluster_number);
+            int skipped_count = volume->directory_entries_per_cluster * chain->extents[j].cluster_count;
+            uint8_t *slots = writable_bytes(volume, skipped_offset, (size_t) skipped_count * sizeof(RootDirectoryEntry));
+            int is_after_marker = j > end_extent_index;
+            for(int k = 0; slots != NULL && k < skipped_count; k++) {
+                if(slots[k * sizeof(RootDirectoryEntry)] == 0x00) is_after_marker = 1;
+                if(is_after_marker) slots[k * sizeof(RootDirectoryEntry)] = 0xE5;
+            }
+        }
+        return found_offset;
+    }
+    return 0;
+}
+
+size_t find_free_directory_slots(Fat12Volume *volume, int directory_cluster, int slots_needed) {
+    // The Root Directory has a fixed size. Any other directory grows by a cluster (or a few) when it's full.
+    int is_past_end = 0;
+    if(directory_cluster == 0) {
+        return find_free_slots_in_run(volume, volume->file_desc_root_directory_offset,
+                volume->boot_record->root_dir_entries_count, slots_needed, &is_past_end);
+    }
+
+    ClusterChain chain;
+    resolve_cluster_chain(volume, directory_cluster, &chain);
+    size_t found_offset = find_free_slots_in_chain(volume, &chain, slots_needed);
+
+    if(found_offset == 0) {
+        int clusters_needed = (slots_needed * sizeof(RootDirectoryEntry) + volume->bytes_per_cluster - 1) / volume->bytes_per_cluster;
+
+        // Files written in between would take the clusters right after the directory, so growing
+        // one cluster at a time splits a big directory into one fragment per cluster.
+        // Doubling it keeps that down to a handful.
+        if(clusters_needed < chain.clusters_count) clusters_needed = chain.clusters_count;
+
+        // The new clusters might not be in one piece, so look again instead of just using the first one.
+        if(grow_directory(volume, &chain, clusters_needed) != 0) {
+            free_cluster_chain(&chain);
+            resolve_cluster_chain(volume, directory_cluster, &chain);
+            found_offset = find_free_slots_in_chain(volume, &chain, slots_needed);
+        }
+    }
+
+    free_cluster_chain(&chain);
+    return found_offset;
+}
+
+int add_directory_entry(Fat12Volume *volume, int directory_cluster, const char *name, uint8_t attribute, int first_cluster_number, uint32_t size, time_t modified) {
+    // Writes the LFN entries (if the name needs them) and the 8.3 entry into the first free slots that fit.
+    uint16_t units[MAX_NAME_LENGTH];
+    int units_count = utf8_to_utf16(name, units, MAX_NAME_LENGTH);
+    uint8_t short_name[11];
+    uint8_t case_flags;
+    int needs_lfn = units_count > 0 ? make_short_name(volume, directory_cluster, name, short_name, &case_flags) : -1;
+    if(needs_lfn < 0) {
+        fprintf(stderr, "Error: %s: Invalid file name\n", name);
+        return -1;
+    }
+
+    int lfn_entries_count = needs_lfn ? (units_count + 12) / 13 : 0;
+    int slots_needed = lfn_entries_count + 1;
+
+    size_t slots_offset = find_free_directory_slots(volume, directory_cluster, slots_needed);
+    uint8_t *slots = slots_offset != 0 ? writable_bytes(volume, slots_offset, slots_needed * sizeof(RootDirectoryEntry)) : NULL;
+    if(slots == NULL) {
+        fprintf(stderr, "Error: %s: Directory is full\n", name);
+        return -1;
+    }
+
+    // LFN entries go in backwards: the last part of the name (with the 0x40 flag) comes first.
+    // After the name there's one 0x0000, and the rest of the entry is 0xFFFF padding.
+    uint8_t checksum = short_name_checksum(short_name);
+    for(int i = 0; i < lfn_entries_count; i++) {
+        int sequence_number = lfn_entries_count - i;
+        LongFileNameEntry *lfn_entry = (LongFileNameEntry *) (slots + i * sizeof(RootDirectoryEntry));
+        memset(lfn_entry, 0, sizeof(LongFileNameEntry));
+        lfn_entry->sequence_number = sequence_number | (i == 0 ? 0x40 : 0);
+        lfn_entry->attribute = 0x0F;
+        lfn_entry->checksum = checksum;
+
+        unsigned char fragment[26];
+        for(int j = 0; j < 13; j++) {
+            int unit_index = (sequence_number - 1) * 13 + j;
+            uint16_t code_unit = unit_index < units_count ? units[unit_index] : unit_index == units_count ? 0x0000 : 0xFFFF;
+            fragment[2 * j] = code_unit & 0xFF;
+            fragment[2 * j + 1] = code_unit >> 8;
+        }
+        memcpy(lfn_entry->name_1, fragment, bytes_name_1);
+        memcpy(lfn_entry->name_2, fragment + bytes_name_1, bytes_name_2);
+        memcpy(lfn_entry->name_3, fragment + bytes_name_1 + bytes_name_2, bytes_name_3);
+    }
+
+    StandardDirectoryEntry *entry = (StandardDirectoryEntry *) (slots + lfn_entries_count * sizeof(RootDirectoryEntry));
+    fill_directory_entry(volume, entry, short_name, attribute, first_cluster_number, size, modified);
+    entry->reserved_windows_nt = case_flags;
+    return 0;
+}
+
+void remove_directory_item(Fat12Volume *volume, const DirectoryItem *item) {
+    // Frees the clusters, and marks the 8.3 entry and its LFN entries as deleted.
+    release_cluster_chain(volume, item->entry->first_cluster_number);
+
+    size_t entry_offset = (const uint8_t *) item->entry - volume->image.data;
+    size_t first_slot_offset = entry_offset - item->lfn_entries_count * sizeof(RootDirectoryEntry);
+    int slots_count = item->lfn_entries_count + 1;
+
+    uint8_t *slots = writable_bytes(volume, first_slot_offset, slots_count * sizeof(RootDirectoryEntry));
+    for(int i = 0; slots != NULL && i < slots_count; i++) {
+        slots[i * sizeof(RootDirectoryEntry)] = 0xE5;
+    }
+}
+
+int resolve_parent_directory(Fat12Volume *volume, const char *path, int *directory_cluster, char *name) {
+    // Splits "/a/b/c.txt" into the first cluster of "/a/b" (0 for the Root Directory) and "c.txt".
+    char parent[PATH_MAX];
+    size_t length = strlen(path);
+    while(length > 0 && path[length - 1] == '/') length--;
+    if(length >= PATH_MAX) {
+        fprintf(stderr, "Error: Path too long: %s\n", path);
+        return -1;
+    }
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+
+    char *last_slash = strrchr(parent, '/');
+    const char *base = last_slash != NULL ? last_slash + 1 : parent;
+    if(*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        fprintf(stderr, "Error: %s: Invalid path\n", path);
+        return -1;
+    }
+    strcpy(name, base);
+    if(last_slash != NULL) *last_slash = '\0';
+    else parent[0] = '\0';
+
+    DirectoryItem item;
+    int found = lookup_path(volume, parent, &item);
+    if(found == 2) {
+        *directory_cluster = 0;
+        return 0;
+    }
+    if(found == 1 && (item.entry->attribute & 0x10)) {
+        *directory_cluster = item.entry->first_cluster_number;
+        return 0;
+    }
+
+    fprintf(stderr, "Error: %s: No such directory\n", parent[0] != '\0' ? parent : "/");
+    return -1;
+}
+
+int mkdir_path(Fat12Volume *volume, const char *path) {
+    int directory_cluster;
+    char name[PATH_MAX];
+    DirectoryItem item;
+
+    if(resolve_parent_directory(volume, path, &directory_cluster, name) != 0) return 1;
+    if(lookup_path(volume, path, &item) != 0) {
+        fprintf(stderr, "Error: %s: Already exists\n", path);
+        return 1;
+    }
+
+    ClusterChain allocated;
+    if(allocate_clusters(volume, 1, 0, &allocated) != 0) {
+        fprintf(stderr, "Error: %s: No space left on image\n", path);
+        return 1;
+    }
+    int first_cluster_number = allocated.extents[0].first_cluster_number;
+    free_cluster_chain(&allocated);
+
+    // A new directory is just "." and "..". ".." is cluster 0 when the parent is the Root Directory.
+    uint8_t *entries = writable_bytes(volume, cluster_offset(volume, first_cluster_number), volume->bytes_per_cluster);
+    if(entries == NULL) {
+        fprintf(stderr, "Error: %s: Image is too small\n", path);
+        release_cluster_chain(volume, first_cluster_number);
+        return 1;
+    }
+    time_t now = time(NULL);
+    memset(entries, 0, volume->bytes_per_cluster);
+    fill_directory_entry(volume, (StandardDirectoryEntry *) entries, (const uint8_t *) ".          ", 0x10, first_cluster_number, 0, now);
+    fill_directory_entry(volume, (StandardDirectoryEntry *) (entries + sizeof(RootDirectoryEntry)), (const uint8_t *) "..         ", 0x10, directory_cluster, 0, now);
+
+    if(add_directory_entry(volume, directory_cluster, name, 0x10, first_cluster_number, 0, now) != 0) {
+        release_cluster_chain(volume, first_cluster_number);
+        return 1;
+    }
+    return 0;
+}
+
+int copy_host_file(Fat12Volume *volume, int host_fd, const struct stat *host_stat, const char *host_path, const char *path) {
+    int directory_cluster;
+    char name[PATH_MAX];
+    DirectoryItem item;
+
+    if(resolve_parent_directory(volume, path, &directory_cluster, name) != 0) return 1;
+
+    int found = lookup_path(volume, path, &item);
+    if(found == 2 || (found == 1 && (item.entry->attribute & 0x10))) {
+        fprintf(stderr, "Error: %s: Is a directory\n", path);
+        return 1;
+    }
+    if(host_stat->st_size > UINT32_MAX) {
+        fprintf(stderr, "Error: %s: Too big for FAT\n", host_path);
+        return 1;
+    }
+    if(found == 1) remove_directory_item(volume, &item);
+
+    size_t size = host_stat->st_size;
+    int clusters_count = (size + volume->bytes_per_cluster - 1) / volume->bytes_per_cluster;
+    ClusterChain allocated = { 0 };
+    if(clusters_count > 0 && allocate_clusters(volume, clusters_count, 0, &allocated) != 0) {
+        fprintf(stderr, "Error: %s: No space left on image\n", path);
+        return 1;
+    }
+
+    // Read straight into the cache, one extent at a time. The end of the last cluster is zeroed.
+    size_t copied = 0;
+    int is_copied = 1;
+    for(int i = 0; is_copied && i < allocated.extents_count; i++) {
+        size_t extent_size = (size_t) allocated.extents[i].cluster_count * volume->bytes_per_cluster;
+        uint8_t *extent_data = writable_bytes(volume, cluster_offset(volume, allocated.extents[i].first_cluster_number), extent_size);
+        size_t wanted = size - copied < extent_size ? size - copied : extent_size;
+        if(extent_data == NULL) {
+            is_copied = 0;
+            break;
+        }
+
+        size_t extent_copied = 0;
+        while(extent_copied < wanted) {
+            ssize_t bytes_read = pread(host_fd, extent_data + extent_copied, wanted - extent_copied, copied + extent_copied);
+            if(bytes_read < 0 && errno == EINTR) continue;
+            if(bytes_read <= 0) break;
+            extent_copied += bytes_read;
+        }
+        if(extent_copied < wanted) is_copied = 0;
+
+        memset(extent_data + wanted, 0, extent_size - wanted);
+        copied += wanted;
+    }
+
+    int first_cluster_number = allocated.extents_count > 0 ? allocated.extents[0].first_cluster_number : 0;
+    free_cluster_chain(&allocated);
+
+    if(!is_copied) {
+        fprintf(stderr, "Error: %s: Could not read the whole file\n", host_path);
+        release_cluster_chain(volume, first_cluster_number);
+        return 1;
+    }
+    if(add_directory_entry(volume, directory_cluster, name, 0x20, first_cluster_number, size, host_stat->st_mtime) != 0) {
+        release_cluster_chain(volume, first_cluster_number);
+        return 1;
+    }
+    return 0;
+}
+
+int put_file(Fat12Volume *volume, const char *host_path, const char *path) {
+    // Copies a host file into the image. An existing file at path is replaced.
+    int host_fd = open(host_path, O_RDONLY);
+    struct stat host_stat;
+    if(host_fd < 0 || fstat(host_fd, &host_stat) != 0 || !S_ISREG(host_stat.st_mode)) {
+        fprintf(stderr, "Error: %s: Not a readable file\n", host_path);
+        if(host_fd >= 0) close(host_fd);
+        return 1;
+    }
+
+    int status = copy_host_file(volume, host_fd, &host_stat, host_path, path);
+    close(host_fd);
+    return status;
+}
+
+int rm_path(Fat12Volume *volume, const char *path) {
+    // Files, and directories that are empty.
+    DirectoryItem item;
+    int found = lookup_path(volume, path, &item);
+    if(found == 0) {
+        fprintf(stderr, "Error: %s: No such file or directory\n", path);
+        return 1;
+    }
+    if(found == 2 || strcmp(item.short_name, ".") == 0 || strcmp(item.short_name, "..") == 0) {
+        fprintf(stderr, "Error: %s: Can't remove this directory\n", path);
+        return 1;
+    }
+
+    if(item.entry->attribute & 0x10) {
+        DirectoryIterator iterator;
+        DirectoryItem child;
+        int is_empty = 1;
+        open_directory(volume, &iterator, item.entry->first_cluster_number);
+        while(is_empty && next_directory_item(&iterator, &child)) {
+            is_empty = strcmp(child.short_name, ".") == 0 || strcmp(child.short_name, "..") == 0;
+        }
+        close_directory(&iterator);
+
+        if(!is_empty) {
+            fprintf(stderr, "Error: %s: Directory not empty\n", path);
+            return 1;
+        }
+    }
+
+    remove_directory_item(volume, &item);
+    return 0;
+}
+
+int import_directory(Fat12Volume *volume, const char *host_directory, const char *path) {
+    // Copies a host directory tree into path, creating path if it isn't there yet.
+    // Entries go in sorted by name, so the same tree always gives the same image.
+    DirectoryItem item;
+    int found = lookup_path(volume, path, &item);
+    if(found == 1 && !(item.entry->attribute & 0x10)) {
+        fprintf(stderr, "Error: %s: Not a directory\n", path);
+        return 1;
+    }
+    if(found == 0 && mkdir_path(volume, path) != 0) return 1;
+
+    struct dirent **names;
+    int names_count = scandir(host_directory, &names, NULL, alphasort);
+    if(names_count < 0) {
+        fprintf(stderr, "Error: %s: Could not read directory\n", host_directory);
+        return 1;
+    }
+
+    // A directory made here gets room for everything that's about to go in it, right away.
+    // Growing it later would put the new clusters after the files, in pieces.
+    // UTF-8 bytes >= UTF-16 units, so this counts at least as many LFN slots as will be used.
+    if(found == 0 && lookup_path(volume, path, &item) == 1) {
+        int slots_needed = 2;
+        for(int i = 0; i < names_count; i++) slots_needed += 1 + (strlen(names[i]->d_name) + 12) / 13;
+
+        ClusterChain chain;
+        resolve_cluster_chain(volume, item.entry->first_cluster_number, &chain);
+        int clusters_needed = (slots_needed * sizeof(RootDirectoryEntry) + volume->bytes_per_cluster - 1) / volume->bytes_per_cluster;
+        if(clusters_needed > chain.clusters_count) grow_directory(volume, &chain, clusters_needed - chain.clusters_count);
+        free_cluster_chain(&chain);
+    }
+
+    int status = 0;
+    for(int i = 0; i < names_count; i++) {
+        const char *name = names[i]->d_name;
+        char host_path[PATH_MAX];
+        char image_path[PATH_MAX];
+        struct stat host_stat;
+
+        if(status != 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        if(snprintf(host_path, PATH_MAX, "%s/%s", host_directory, name) >= PATH_MAX ||
+           snprintf(image_path, PATH_MAX, "%s/%s", path, name) >= PATH_MAX) {
+            fprintf(stderr, "Error: Path too long: %s/%s\n", host_directory, name);
+            status = 1;
+        } else if(stat(host_path, &host_stat) != 0) {
+            fprintf(stderr, "Error: %s: Could not stat\n", host_path);
+            status = 1;
+        } else if(S_ISDIR(host_stat.st_mode)) {
+            status = import_directory(volume, host_path, image_path);
+        } else if(S_ISREG(host_stat.st_mode)) {
+            status = put_file(volume, host_path, image_path);
+        } else {
+            fprintf(stderr, "Warning: %s: Not a file or directory, skipped\n", host_path);
+        }
+    }
+
+    for(int i = 0; i < names_count; i++) free(names[i]);
+    free(names);
+    return status;
+}
+
+int write_volume(Fat12Volume *volume, const char *command, int arguments_count, const char **arguments) {
+    // put and import take (host path, image path) pairs, mkdir and rm take image paths.
+    // Everything happens in the cache first. The image is only written if every step worked.
+    int status = 0;
+
+    if(strcmp(command, "put") == 0 || strcmp(command, "import") == 0) {
+        for(int i = 0; status == 0 && i + 1 < arguments_count; i += 2) {
+            status = command[0] == 'p'
+                ? put_file(volume, arguments[i], arguments[i + 1])
+                : import_directory(volume, arguments[i], arguments[i + 1]);
+        }
+    } else if(strcmp(command, "mkdir") == 0) {
+        for(int i = 0; status == 0 && i < arguments_count; i++) status = mkdir_path(volume, arguments[i]);
+    } else {
+        for(int i = 0; status == 0 && i < arguments_count; i++) status = rm_path(volume, arguments[i]);
+    }
+
+    if(status != 0) {
+        fprintf(stderr, "Error: %s: Nothing was written\n", volume->image_path);
+        return status;
+    }
+    return flush_volume(volume) != 0;
+}
+
+int start_image(Fat12Volume *volume, const char *image_path, const uint8_t *boot_sector, size_t boot_sector_size, const char *source) {
+    // Sets up an empty in-memory image from a boot sector: the boot sector itself, empty FATs, and an empty
+    // Root Directory with the volume label. Nothing is written until finish_image().
+    // The geometry comes from the BPB in the boot sector.
+    volume->image_path = image_path;
+
+    const BootRecord *source_boot_record = (const BootRecord *) boot_sector;
+    volume->image.size = (size_t) source_boot_record->total_sectors * source_boot_record->bytes_per_sector;
+    volume->image.data = (const uint8_t *) calloc(volume->image.size > 0 ? volume->image.size : 1, 1);
+    if(volume->image.data == NULL || volume->image.size < boot_sector_size) {
+        fprintf(stderr, "Error: %s: Boot record describes a %zu byte image\n", source, volume->image.size);
+        return 1;
+    }
+    memcpy((uint8_t *) volume->image.data, boot_sector, boot_sector_size);
+
+    if(read_boot_drive_section(volume) != 0 || read_file_allocation_table_section(volume) != 0) return 1;
+    if(boot_sector_size > (size_t) volume->file_desc_fat_section_offset) {
+        fprintf(stderr, "Error: %s: Bootloader runs into the FAT\n", source);
+        return 1;
+    }
+
+    int bytes_per_sector = volume->boot_record->bytes_per_sector;
+    volume->sectors_count = (volume->image.size + bytes_per_sector - 1) / bytes_per_sector;
+    volume->dirty_sectors = (uint8_t *) calloc(volume->sectors_count, 1);
+    if(volume->dirty_sectors == NULL) return 1;
+
+    // Same inputs, same image: every entry gets SOURCE_DATE_EPOCH (in UTC), or else 1980-01-01 00:00:00.
+    const char *source_date_epoch = getenv("SOURCE_DATE_EPOCH");
+    time_t fixed_timestamp = source_date_epoch != NULL ? (time_t) strtoll(source_date_epoch, NULL, 10) : 315532800;
+    struct tm fixed_tm;
+    gmtime_r(&fixed_timestamp, &fixed_tm);
+    tm_to_fat_date_time(&fixed_tm, &volume->fixed_date, &volume->fixed_time);
+    volume->has_fixed_timestamp = 1;
+
+    // FAT entries 0 and 1 are reserved: the media descriptor, and an end of chain marker.
+    set_fat_entry(volume, 0, 0xF00 | volume->boot_record->media_descriptor);
+    set_fat_entry(volume, 1, 0xFFF);
+
+    // mkfs.fat also puts the volume label in the Root Directory.
+    if(volume->extended_boot_record->signature == 0x29 && memcmp(volume->extended_boot_record->volume_label, "NO NAME    ", 11) != 0) {
+        uint8_t *label_slot = writable_bytes(volume, volume->file_desc_root_directory_offset, sizeof(RootDirectoryEntry));
+        if(label_slot != NULL) {
+            fill_directory_entry(volume, (StandardDirectoryEntry *) label_slot, volume->extended_boot_record->volume_label, 0x08, 0, 0, 0);
+        }
+    }
+    return 0;
+}
+
+int finish_image(Fat12Volume *volume, const char *image_path) {
+    // Packs the FAT into every copy, and writes the whole image out with a single write.
+    sync_fat_copies(volume);
+
+    int image_fd = open(image_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(image_fd < 0 || write_all(image_fd, volume->image.data, volume->image.size) != 0) {
+        fprintf(stderr, "Error: Could not write image file %s\n", image_path);
+        if(image_fd >= 0) close(image_fd);
+        return 1;
+    }
+    STATS_ADD(volume, write_calls, 1);
+    STATS_ADD(volume, bytes_written, volume->image.size);
+    close(image_fd);
+    return 0;
+}
+
+int make_image(Fat12Volume *volume, const char *image_path, const char *bootloader_path, int arguments_count, const char **arguments) {
+    // Builds a whole image in memory from the bootloader and (host directory, path) pairs,
+    // then writes it out with a single write. Replaces dd + mkfs.fat + mcopy + dd.
+    // The geometry comes from the BPB in the bootloader, since that's what ended up in the boot sector anyway.
+    int bootloader_fd = open(bootloader_path, O_RDONLY);
+    struct stat bootloader_stat;
+    if(bootloader_fd < 0 || fstat(bootloader_fd, &bootloader_stat) != 0) {
+        fprintf(stderr, "Error: Could not open bootloader %s\n", bootloader_path);
+        if(bootloader_fd >= 0) close(bootloader_fd);
+        return 1;
+    }
+
+    size_t bootloader_size = bootloader_stat.st_size;
+    uint8_t *bootloader = (uint8_t *) malloc(bootloader_size > 0 ? bootloader_size : 1);
+    size_t bootloader_read = 0;
+    while(bootloader != NULL && bootloader_read < bootloader_size) {
+        ssize_t bytes_read = read(bootloader_fd, bootloader + bootloader_read, bootloader_size - bootloader_read);
+        if(bytes_read < 0 && errno == EINTR) continue;
+        if(bytes_read <= 0) break;
+        bootloader_read += bytes_read;
+    }
+    close(bootloader_fd);
+
+    if(bootloader == NULL || bootloader_read != bootloader_size || bootloader_size < sizeof(BootRecord) + sizeof(ExtendedBootRecord)) {
+        fprintf(stderr, "Error: %s: Too small to hold a boot record\n", bootloader_path);
+        free(bootloader);
+        return 1;
+    }
+
+    int status = start_image(volume, image_path, bootloader, bootloader_size, bootloader_path);
+    free(bootloader);
+    if(status != 0) return 1;
+
+    for(int i = 0; i + 1 < arguments_count; i += 2) {
+        if(import_directory(volume, arguments[i], arguments[i + 1]) != 0) {
+            fprintf(stderr, "Error: %s: Nothing was written\n", image_path);
+            return 1;
+        }
+    }
+    return finish_image(volume, image_path);
+}
+
+// Synthetic images for benchmarking. Each shape is the worst case for one part of the reader,
+// and the same seed always gives the same image (names, sizes, contents and timestamps).
+uint64_t next_random(uint64_t *state) {
+    // xorshift64*. Good enough for file contents and sizes, and it's the same everywhere.
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+int fill_chain_with_random(Fat12Volume *volume, int first_cluster_number, uint32_t size, uint64_t *random_state) {
+    // Random bytes up to size, zeros for the rest of the last cluster.
+    ClusterChain chain;
+    resolve_cluster_chain(volume, first_cluster_number, &chain);
+
+    size_t filled = 0;
+    for(int i = 0; i < chain.extents_count; i++) {
+        size_t extent_size = (size_t) chain.extents[i].cluster_count * volume->bytes_per_cluster;
+        uint8_t *extent_data = writable_bytes(volume, cluster_offset(volume, chain.extents[i].first_cluster_number), extent_size);
+        if(extent_data == NULL) {
+            free_cluster_chain(&chain);
+            return -1;
+        }
+
+        size_t wanted = size - filled < extent_size ? size - filled : extent_size;
+        for(size_t j = 0; j < wanted; j += 8) {
+            uint64_t value = next_random(random_state);
+            memcpy(extent_data + j, &value, wanted - j < 8 ? wanted - j : 8);
+        }
+        memset(extent_data + wanted, 0, extent_size - wanted);
+        filled += wanted;
+    }
+    free_cluster_chain(&chain);
+    return 0;
+}
+
+int add_synthetic_file(Fat12Volume *volume, const char *path, uint32_t size, uint64_t *random_state) {
+    // Like put, but the contents are random, and the file goes into one piece if it can.
+    int directory_cluster;
+    char name[PATH_MAX];
+    if(resolve_parent_directory(volume, path, &directory_cluster, name) != 0) return 1;
+
+    int clusters_count = (size + volume->bytes_per_cluster - 1) / volume->bytes_per_cluster;
+    ClusterChain allocated = { 0 };
+    if(clusters_count > 0 && allocate_clusters(volume, clusters_count, 0, &allocated) != 0) {
+        fprintf(stderr, "Error: %s: No space left on image\n", path);
+        return 1;
+    }
+    int first_cluster_number = allocated.extents_count > 0 ? allocated.extents[0].first_cluster_number : 0;
+    free_cluster_chain(&allocated);
+
+    if(fill_chain_with_random(volume, first_cluster_number, size, random_state) != 0 ||
+       add_directory_entry(volume, directory_cluster, name, 0x20, first_cluster_number, size, 0) != 0) {
+        release_cluster_chain(volume, first_cluster_number);
+        return 1;
+    }
+    return 0;
+}
+
+int count_free_clusters(Fat12Volume *volume) {
+    int free_count = 0;
+    for(int cluster_number = 2; cluster_number < volume->fat_table_entries_count; cluster_number++) {
+        free_count += volume->fat_table[cluster_number] == 0;
+    }
+    return free_count;
+}
+
+#define FRAGMENTED_FILES_COUNT 32
+
+int make_fragmented_files(Fat12Volume *volume, uint64_t *random_state) {
+    // 32 files that all grow at the same time, a few clusters at a time, in random order.
+    // Every file ends up in dozens of small extents, interleaved with all the others.
+    // About 1/8 of the disk is left free, in one piece at the end.
+    int first_clusters[FRAGMENTED_FILES_COUNT] = { 0 };
+    int last_clusters[FRAGMENTED_FILES_COUNT] = { 0 };
+    int clusters_counts[FRAGMENTED_FILES_COUNT] = { 0 };
+    int clusters_left = count_free_clusters(volume) * 7 / 8;
+
+    while(clusters_left > 0) {
+        int file = next_random(random_state) % FRAGMENTED_FILES_COUNT;
+        int grow_by = 1 + next_random(random_state) % 3;
+        if(grow_by > clusters_left) grow_by = clusters_left;
+
+        ClusterChain allocated;
+        if(allocate_clusters(volume, grow_by, last_clusters[file], &allocated) != 0) break;
+        const ClusterExtent *last_extent = &allocated.extents[allocated.extents_count - 1];
+        if(first_clusters[file] == 0) first_clusters[file] = allocated.extents[0].first_cluster_number;
+        last_clusters[file] = last_extent->first_cluster_number + last_extent->cluster_count - 1;
+        clusters_counts[file] += grow_by;
+        clusters_left -= grow_by;
+        free_cluster_chain(&allocated);
+    }
+
+    for(int file = 0; file < FRAGMENTED_FILES_COUNT; file++) {
+        // The last cluster is only partly used.
+        uint32_t size = clusters_counts[file] > 0
+            ? (uint32_t) clusters_counts[file] * volume->bytes_per_cluster - next_random(random_state) % volume->bytes_per_cluster
+            : 0;
+        char name[16];
+        snprintf(name, sizeof(name), "FRAG%03d.BIN", file);
+        if(fill_chain_with_random(volume, first_clusters[file], size, random_state) != 0 ||
+           add_directory_entry(volume, 0, name, 0x20, first_clusters[file], size, 0) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int make_full_root(Fat12Volume *volume, uint64_t *random_state) {
+    // Fills every Root Directory slot left after the volume label with small 8.3 files.
+    int slots_count = volume->boot_record->root_dir_entries_count - 1;
+    for(int i = 0; i < slots_count; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/F%05d.TXT", i);
+        if(add_synthetic_file(volume, path, next_random(random_state) % (4 * volume->bytes_per_cluster), random_state) != 0) return 1;
+    }
+    return 0;
+}
+
+#define DEEP_DIRECTORIES_COUNT 100
+
+int make_deep_directories(Fat12Volume *volume, uint64_t *random_state) {
+    // /D000/D001/.../D099, with one small file at every level.
+    char path[PATH_MAX] = "";
+    size_t length = 0;
+    for(int depth = 0; depth < DEEP_DIRECTORIES_COUNT; depth++) {
+        length += snprintf(path + length, sizeof(path) - length, "/D%03d", depth);
+        if(mkdir_path(volume, path) != 0) return 1;
+
+        snprintf(path + length, sizeof(path) - length, "/LEAF.TXT");
+        if(add_synthetic_file(volume, path, next_random(random_state) % (2 * volume->bytes_per_cluster), random_state) != 0) return 1;
+        path[length] = '\0';
+    }
+    return 0;
+}
+
+#define LONG_NAMES_COUNT 100
+
+int make_long_names(Fat12Volume *volume, uint64_t *random_state) {
+    // Names of the full 255 characters, so every file takes 20 LFN entries and a ~N short name.
+    // 10 in the Root Directory (all that fit), and 100 more in /LONGNAMES.
+    if(mkdir_path(volume, "/LONGNAMES") != 0) return 1;
+
+    const char characters[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+    for(int i = 0; i < 10 + LONG_NAMES_COUNT; i++) {
+        char path[16 + MAX_NAME_LENGTH + 1];
+        int length = snprintf(path, sizeof(path), "%s/%03d_", i < 10 ? "" : "/LONGNAMES", i);
+        int name_start = i < 10 ? 1 : 11;
+        while(length - name_start < MAX_NAME_LENGTH - 4) {
+            path[length++] = characters[next_random(random_state) % (sizeof(characters) - 1)];
+        }
+        memcpy(path + length, ".txt", 5);
+
+        if(add_synthetic_file(volume, path, next_random(random_state) % (3 * volume->bytes_per_cluster), random_state) != 0) return 1;
+    }
+    return 0;
+}
+
+int make_filling_file(Fat12Volume *volume, uint64_t *random_state) {
+    // One file that takes every free cluster.
+    uint32_t size = (uint32_t) count_free_clusters(volume) * volume->bytes_per_cluster - next_random(random_state) % volume->bytes_per_cluster;
+    return add_synthetic_file(volume, "/FILL.BIN", size, random_state);
+}
+
+typedef struct {
+    const char *name;
+    int (*make)(Fat12Volume *volume, uint64_t *random_state);
+} SyntheticShape;
+
+const SyntheticShape synthetic_shapes[] = {
+    { "fragmented", make_fragmented_files },
+    { "full-root", make_full_root },
+    { "deep", make_deep_directories },
+    { "long-names", make_long_names },
+    { "fill", make_filling_file },
+};
+
+int make_synthetic_image(Fat12Volume *volume, const char *image_path, const char *shape_name, const char *seed_text) {
+    // A standard 1.44 MB floppy, like mkfs.fat makes, with no boot code.
+    const SyntheticShape *shape = NULL;
+    for(size_t i = 0; i < sizeof(synthetic_shapes) / sizeof(synthetic_shapes[0]); i++) {
+        if(strcmp(synthetic_shapes[i].name, shape_name) == 0) shape = &synthetic_shapes[i];
+    }
+    char *seed_end;
+    uint64_t seed = strtoull(seed_text, &seed_end, 0);
+    if(shape == NULL || *seed_text == '\0' || *seed_end != '\0') {
+        fprintf(stderr, "Error: Unknown shape %s or bad seed %s (shapes: fragmented, full-root, deep, long-names, fill)\n", shape_name, seed_text);
+        return 1;
+    }
+
+    uint8_t boot_sector[512] = { 0 };
+    BootRecord *boot_record = (BootRecord *) boot_sector;
+    ExtendedBootRecord *extended_boot_record = (ExtendedBootRecord *) (boot_sector + sizeof(BootRecord));
+    memcpy(boot_record->jmp_short_nop, "\xEB\x3C\x90", 3);
+    memcpy(boot_record->oem_identifier, "MSWIN4.1", 8);
+    boot_record->bytes_per_sector = 512;
+    boot_record->sectors_per_cluster = 1;
+    boot_record->reserved_sectors = 1;
+    boot_record->fat_count = 2;
+    boot_record->root_dir_entries_count = 224;
+    boot_record->total_sectors = 2880;
+    boot_record->media_descriptor = 0xF0;
+    boot_record->sectors_per_fat = 9;
+    boot_record->sectors_per_track = 18;
+    boot_record->heads = 2;
+    extended_boot_record->signature = 0x29;
+    extended_boot_record->volume_id = (uint32_t) seed;
+    memcpy(extended_boot_record->volume_label, "BENCH      ", 11);
+    memcpy(extended_boot_record->system_identifier, "FAT12   ", 8);
+    extended_boot_record->boot_signature = 0xAA55;
+
+    // xorshift gets stuck on 0, so the seed is mixed first.
+    uint64_t random_state = seed * 0x9E3779B97F4A7C15ull + 1;
+    if(start_image(volume, image_path, boot_sector, sizeof(boot_sector), shape_name) != 0) return 1;
+    if(shape->make(volume, &random_state) != 0) {
+        fprintf(stderr, "Error: %s: Nothing was written\n", image_path);
+        return 1;
+    }
+    return finish_image(volume, image_path);
+}
+
+// Streaming mode: the image comes in on a pipe and is read strictly front to back, with no seeking.
+// Everything in front of the Data Section (boot record, FATs, Root Directory) is small, and is kept.
+// The Data Section is read one cluster at a time, and every cluster is handed to the file or
+// directory whose chain it's in as it goes past. A directory is parsed once all of its clusters are in,
+// which makes the chains of its children known.
+// An allocated cluster that no known chain claims yet might belong to a directory that hasn't been
+// parsed, so a copy is kept until it's claimed, or until there's no directory left to parse.
+// Clusters that go past one after another in the same file are put together, and written with one pwrite.
+#define STREAM_RUN_SIZE (64 * 1024)
+
+typedef struct {
+    char path[PATH_MAX];
+    int is_directory;
+    uint32_t size;
+    time_t modified;
+
+    int clusters_count;
+    int clusters_done;
+
+    // Files only, when extracting: open from when the file is claimed until its last cluster is written. -1 otherwise.
+    int fd;
+
+    // Directories only: all of their clusters, in chain order.
+    uint8_t *directory_data;
+} StreamNode;
+
+typedef struct {
+    Fat12Volume *volume;
+    const char *output_directory; // NULL to just list the entries.
+    ListingTotals totals;
+
+    StreamNode *nodes;
+    int nodes_count;
+    int nodes_capacity;
+
+    // Per cluster: the node whose chain has it (-1 if none yet), and where in that chain it is.
+    int *owner;
+    int *chain_position;
+    int next_cluster_number;
+
+    // Copies of clusters that went past before anything claimed them.
+    uint8_t **pending;
+    int pending_count;
+    int *ready;
+    int ready_count;
+
+    // The file data that hasn't been written yet: run_length bytes of one node, from run_offset on.
+    uint8_t *run_data;
+    size_t run_capacity;
+    int run_node_index;
+    size_t run_offset;
+    size_t run_length;
+
+    int open_directories_count;
+    int files_count;
+    int directories_count;
+    int failed_count;
+    uint64_t bytes_written;
+} StreamScan;
+
+size_t read_stream(Fat12Volume *volume, int fd, uint8_t *buffer, size_t size) {
+    // Reads exactly size bytes, unless the stream ends first. Pipes hand data out in small pieces.
+    size_t done = 0;
+    while(done < size) {
+        ssize_t bytes_read = read(fd, buffer + done, size - done);
+        STATS_ADD(volume, read_calls, 1);
+        if(bytes_read > 0) STATS_ADD(volume, bytes_read, bytes_read);
+        if(bytes_read < 0 && errno == EINTR) continue;
+        if(bytes_read <= 0) break;
+        done += bytes_read;
+    }
+    return done;
+}
+
+void drop_pending_clusters(StreamScan *scan) {
+    // Claimed copies are still waiting in the ready list, so only the unclaimed ones go.
+    for(int i = 0; i < scan->volume->fat_table_entries_count && scan->pending_count > 0; i++) {
+        if(scan->pending[i] != NULL && scan->owner[i] < 0) {
+            free(scan->pending[i]);
+            scan->pending[i] = NULL;
+            scan->pending_count--;
+        }
+    }
+}
+
+void flush_stream_run(StreamScan *scan) {
+    if(scan->run_length == 0) return;
+
+    StreamNode *node = &scan->nodes[scan->run_node_index];
+    if(pwrite_all(node->fd, scan->run_data, scan->run_length, scan->run_offset) != 0) {
+        fprintf(stderr, "Error: Could not write to %s\n", node->path);
+        scan->failed_count++;
+    } else {
+        scan->bytes_written += scan->run_length;
+        STATS_ADD(scan->volume, write_calls, 1);
+        STATS_ADD(scan->volume, bytes_written, scan->run_length);
+    }
+    scan->run_length = 0;
+}
+
+void finish_stream_node(StreamScan *scan, int node_index);
+
+void claim_stream_node(StreamScan *scan, const char *path, const DirectoryItem *item) {
+    Fat12Volume *volume = scan->volume;
+    int is_directory = (item->entry->attribute & 0x10) != 0;
+
+    char host_path[PATH_MAX];
+    int fd = -1;
+    if(scan->output_directory == NULL) {
+        list_entry(volume, path, item, &scan->totals);
+    } else if(snprintf(host_path, PATH_MAX, "%s%s", scan->output_directory, path) >= PATH_MAX) {
+        fprintf(stderr, "Error: Path too long: %s%s\n", scan->output_directory, path);
+        scan->failed_count++;
+        return;
+    } else if(is_directory) {
+        if(mkdir(host_path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Could not create directory %s\n", host_path);
+            scan->failed_count++;
+            return;
+        }
+    } else {
+        // Created empty now, and kept open. The data is written whenever its clusters go past.
+        fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            fprintf(stderr, "Error: Could not create %s\n", host_path);
+            scan->failed_count++;
+            return;
+        }
+    }
+
+    if(scan->nodes_count == scan->nodes_capacity) {
+        scan->nodes_capacity = scan->nodes_capacity > 0 ? 2 * scan->nodes_capacity : 64;
+        scan->nodes = (StreamNode *) realloc(scan->nodes, sizeof(StreamNode) * scan->nodes_capacity);
+    }
+    int node_index = scan->nodes_count++;
+    StreamNode *node = &scan->nodes[node_index];
+    memset(node, 0, sizeof(StreamNode));
+    strcpy(node->path, scan->output_directory != NULL ? host_path : path);
+    node->is_directory = is_directory;
+    node->fd = fd;
+    node->size = item->entry->file_size_in_bytes;
+    node->modified = fat_date_time_to_time(item->entry->last_modified_date, item->entry->last_modified_time);
+    if(is_directory) scan->directories_count++;
+    else scan->files_count++;
+
+    ClusterChain chain;
+    resolve_cluster_chain(volume, item->entry->first_cluster_number, &chain);
+    if(is_directory) {
+        node->directory_data = (uint8_t *) calloc((size_t) chain.clusters_count * volume->bytes_per_cluster + 1, 1);
+        scan->open_directories_count++;
+    }
+
+    int position = 0;
+    int is_looped = 0;
+    for(int i = 0; !is_looped && i < chain.extents_count; i++) {
+        const ClusterExtent *extent = &chain.extents[i];
+        for(int cluster_number = extent->first_cluster_number; cluster_number < extent->first_cluster_number + extent->cluster_count; cluster_number++, position++) {
+            // A broken FAT can point past the last cluster. Nothing will ever come from there.
+            if(cluster_number >= volume->fat_table_entries_count) {
+                fprintf(stderr, "Warning: %s: Cluster %d is past the end of the FAT, skipped\n", path, cluster_number);
+                continue;
+            }
+            // A cluster can only go to one chain. The other one gets zeros there.
+            // Running into its own cluster is a loop, and everything after that is the same clusters again.
+            if(scan->owner[cluster_number] == node_index) {
+                fprintf(stderr, "Warning: %s: Chain loops back on itself at cluster %d\n", path, cluster_number);
+                is_looped = 1;
+                break;
+            }
+            if(scan->owner[cluster_number] >= 0) {
+                fprintf(stderr, "Warning: %s: Cluster %d is cross-linked, skipped\n", path, cluster_number);
+                continue;
+            }
+            scan->owner[cluster_number] = node_index;
+            scan->chain_position[cluster_number] = position;
+            node->clusters_count++;
+
+            // Already went past. Either there's a copy, or it wasn't even allocated and it's gone.
+            if(scan->pending[cluster_number] != NULL) {
+                scan->ready[scan->ready_count++] = cluster_number;
+            } else if(cluster_number < scan->next_cluster_number) {
+                node->clusters_done++;
+            }
+        }
+    }
+    free_cluster_chain(&chain);
+
+    if(node->clusters_done == node->clusters_count) finish_stream_node(scan, node_index);
+}
+
+void finish_stream_node(StreamScan *scan, int node_index) {
+    Fat12Volume *volume = scan->volume;
+    StreamNode *node = &scan->nodes[node_index];
+
+    if(!node->is_directory) {
+        if(node->fd >= 0) {
+            if(scan->run_node_index == node_index) flush_stream_run(scan);
+            struct timespec times[2] = { { node->modified, 0 }, { node->modified, 0 } };
+            futimens(node->fd, times);
+            close(node->fd);
+            node->fd = -1;
+        }
+        return;
+    }
+
+    // Claiming children can move the nodes array, so only the index and a copy of the path are kept.
+    char path[PATH_MAX];
+    strcpy(path, node->path);
+    uint8_t *directory_data = node->directory_data;
+    int entries_count = node->clusters_count * volume->directory_entries_per_cluster;
+    node->directory_data = NULL;
+
+    DirectoryIterator iterator;
+    DirectoryItem item;
+    memset(&iterator, 0, sizeof(DirectoryIterator));
+    iterator.volume = volume;
+    iterator.entries = (const RootDirectoryEntry *) directory_data;
+    scan_iterator_entries(&iterator, entries_count);
+
+    // The listing paths are image paths, the extract paths are host paths. Either way children go under it.
+    while(next_directory_item(&iterator, &item)) {
+        if(strcmp(item.long_name, ".") == 0 || strcmp(item.long_name, "..") == 0) continue;
+        for(char *c = item.long_name; *c != '\0'; c++) {
+            if(*c == '/') *c = '_';
+        }
+
+        char child_path[PATH_MAX];
+        const char *parent_path = scan->output_directory != NULL ? path + strlen(scan->output_directory) : path;
+        if(snprintf(child_path, PATH_MAX, "%s/%s", parent_path, item.long_name) >= PATH_MAX) {
+            fprintf(stderr, "Error: Path too long: %s/%s\n", parent_path, item.long_name);
+            scan->failed_count++;
+            continue;
+        }
+        claim_stream_node(scan, child_path, &item);
+    }
+    close_directory(&iterator);
+    free(directory_data);
+
+    // With every directory parsed, nothing new can be claimed. Copies are no use anymore.
+    if(--scan->open_directories_count == 0) drop_pending_clusters(scan);
+}
+
+void deliver_stream_cluster(StreamScan *scan, int cluster_number, const uint8_t *data) {
+    Fat12Volume *volume = scan->volume;
+    int node_index = scan->owner[cluster_number];
+    StreamNode *node = &scan->nodes[node_index];
+    size_t file_offset = (size_t) scan->chain_position[cluster_number] * volume->bytes_per_cluster;
+
+    if(node->is_directory) {
+        memcpy(node->directory_data + file_offset, data, volume->bytes_per_cluster);
+    } else if(node->fd >= 0 && file_offset < node->size) {
+        // In a layout like mcopy's, each file's clusters come in one run, so the whole file is a few writes.
+        // Files can be interleaved on disk though. Anything that doesn't carry on the run writes it out first.
+        size_t length = node->size - file_offset < (size_t) volume->bytes_per_cluster ? node->size - file_offset : (size_t) volume->bytes_per_cluster;
+        if(scan->run_length > 0 && (scan->run_node_index != node_index || scan->run_offset + scan->run_length != file_offset ||
+                scan->run_length + length > scan->run_capacity)) {
+            flush_stream_run(scan);
+        }
+        if(scan->run_length == 0) {
+            scan->run_node_index = node_index;
+            scan->run_offset = file_offset;
+        }
+        memcpy(scan->run_data + scan->run_length, data, length);
+        scan->run_length += length;
+    }
+
+    if(++node->clusters_done == node->clusters_count) finish_stream_node(scan, node_index);
+}
+
+int stream_volume(Fat12Volume *volume, int fd, const char *output_directory, OutputFormat format) {
+    StreamScan scan = { 0 };
+    scan.volume = volume;
+    scan.output_directory = output_directory;
+    scan.totals.format = format;
+    volume->image_path = "<stdin>";
+
+    // The boot record says how big everything in front of the Data Section is.
+    // The rest of that is read into the same buffer, which then works like any other image.
+    uint8_t *head = (uint8_t *) malloc(sizeof(BootRecord) + sizeof(ExtendedBootRecord));
+    size_t head_size = read_stream(volume, fd, head, sizeof(BootRecord) + sizeof(ExtendedBootRecord));
+    volume->image.data = head;
+    volume->image.size = head_size;
+    if(read_boot_drive_section(volume) != 0) return 1;
+
+    size_t wanted_size = volume->file_desc_data_section_offset;
+    if(wanted_size > head_size) {
+        head = (uint8_t *) realloc(head, wanted_size);
+        head_size += read_stream(volume, fd, head + head_size, wanted_size - head_size);
+        volume->image.data = head;
+        volume->image.size = head_size;
+        if(read_boot_drive_section(volume) != 0) return 1;
+    }
+    if(head_size < wanted_size || read_file_allocation_table_section(volume) != 0) {
+        fprintf(stderr, "Error: %s: Image ends before the Data Section\n", volume->image_path);
+        return 1;
+    }
+
+    int entries_count = volume->fat_table_entries_count;
+    scan.owner = (int *) malloc(sizeof(int) * entries_count);
+    scan.chain_position = (int *) malloc(sizeof(int) * entries_count);
+    scan.pending = (uint8_t **) calloc(entries_count, sizeof(uint8_t *));
+    scan.ready = (int *) malloc(sizeof(int) * entries_count);
+    for(int i = 0; i < entries_count; i++) scan.owner[i] = -1;
+    scan.next_cluster_number = 2;
+
+    scan.run_node_index = -1;
+    if(output_directory != NULL) {
+        if(mkdir(output_directory, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Could not create directory %s\n", output_directory);
+            scan.failed_count++;
+        }
+        scan.run_capacity = volume->bytes_per_cluster > STREAM_RUN_SIZE ? volume->bytes_per_cluster : STREAM_RUN_SIZE;
+        scan.run_data = (uint8_t *) malloc(scan.run_capacity);
+
+        // Every file that's claimed but not complete yet keeps its descriptor, and a floppy can hold thousands of files.
+        struct rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+    if(output_directory == NULL) print_records_header(volume, format);
+
+    // The Root Directory is already here.
+    DirectoryIterator iterator;
+    DirectoryItem item;
+    open_root_directory(volume, &iterator);
+    while(scan.failed_count == 0 && next_directory_item(&iterator, &item)) {
+        char path[PATH_MAX];
+        for(char *c = item.long_name; *c != '\0'; c++) {
+            if(*c == '/') *c = '_';
+        }
+        snprintf(path, PATH_MAX, "/%s", item.long_name);
+        claim_stream_node(&scan, path, &item);
+    }
+    close_directory(&iterator);
+
+    uint8_t *cluster = (uint8_t *) malloc(volume->bytes_per_cluster);
+    int is_truncated = 0;
+    for(int cluster_number = 2; cluster_number < entries_count; cluster_number++) {
+        if(read_stream(volume, fd, cluster, volume->bytes_per_cluster) != (size_t) volume->bytes_per_cluster) {
+            is_truncated = 1;
+            break;
+        }
+        if(volume->stats != NULL) count_region_bytes(volume, volume->file_desc_data_section_offset, volume->bytes_per_cluster);
+        scan.next_cluster_number = cluster_number + 1;
+
+        if(scan.owner[cluster_number] >= 0) {
+            deliver_stream_cluster(&scan, cluster_number, cluster);
+        } else if(scan.open_directories_count > 0 && volume->fat_table[cluster_number] != 0) {
+            scan.pending[cluster_number] = (uint8_t *) malloc(volume->bytes_per_cluster);
+            memcpy(scan.pending[cluster_number], cluster, volume->bytes_per_cluster);
+            scan.pending_count++;
+        }
+
+        // Clusters that a directory parsed just now claimed, but that already went past.
+        while(scan.ready_count > 0) {
+            int ready_cluster_number = scan.ready[--scan.ready_count];
+            uint8_t *data = scan.pending[ready_cluster_number];
+            scan.pending[ready_cluster_number] = NULL;
+            scan.pending_count--;
+            deliver_stream_cluster(&scan, ready_cluster_number, data);
+            free(data);
+        }
+    }
+
+    // Read whatever is left, so the program writing into the pipe doesn't get a broken pipe.
+    while(!is_truncated && read_stream(volume, fd, cluster, volume->bytes_per_cluster) > 0);
+    free(cluster);
+
+    // Files that never got all of their clusters are still open, with some of their data not written yet.
+    flush_stream_run(&scan);
+    free(scan.run_data);
+    int incomplete_count = 0;
+    for(int i = 0; i < scan.nodes_count; i++) {
+        if(scan.nodes[i].clusters_done < scan.nodes[i].clusters_count) incomplete_count++;
+        if(scan.nodes[i].fd >= 0) close(scan.nodes[i].fd);
+        free(scan.nodes[i].directory_data);
+    }
+    if(is_truncated) {
+        fprintf(stderr, "Error: %s: Image ends early, %d files / directories are incomplete\n", volume->image_path, incomplete_count);
+    }
+
+    if(output_directory != NULL) {
+        out_printf(volume->out, "Extracted %d files, %d directories, %llu bytes into %s\n",
+                scan.files_count, scan.directories_count, (unsigned long long) scan.bytes_written, output_directory);
+    } else if(format == FORMAT_SUMMARY) {
+        scan.totals.clusters_count = entries_count - 2;
+        for(int i = 2; i < entries_count; i++) {
+            if(volume->fat_table[i] == 0) scan.totals.free_clusters_count++;
+        }
+        out_printf(volume->out, "Volume Label        : %.11s\n", volume->extended_boot_record->volume_label);
+        out_printf(volume->out, "Files               : %d\n", scan.totals.files_count);
+        out_printf(volume->out, "Directories         : %d\n", scan.totals.directories_count);
+        out_printf(volume->out, "Bytes in Files      : %llu\n", (unsigned long long) scan.totals.bytes_count);
+        out_printf(volume->out, "Clusters            : %d\n", scan.totals.clusters_count);
+        out_printf(volume->out, "Free Clusters       : %d\n", scan.totals.free_clusters_count);
+        out_printf(volume->out, "Bytes per Cluster   : %d\n", volume->bytes_per_cluster);
+    }
+
+    drop_pending_clusters(&scan);
+    free(scan.nodes);
+    free(scan.owner);
+    free(scan.chain_position);
+    free(scan.pending);
+    free(scan.ready);
+    return is_truncated || incomplete_count > 0 || scan.failed_count > 0;
+}
+
+// Batch mode. Every image gets its own Fat12Volume, and the images are spread over
+// the work-stealing pool. Results are printed in input order once everything is done.
+typedef struct {
+    const char *image_path;
+    int status;
+    ListingTotals totals;
+} BatchResult;
+
+typedef struct {
+    BatchResult *results;
+    int results_count;
+    int results_capacity;
+} BatchPlan;
+
+void add_batch_image(BatchPlan *plan, const char *image_path) {
+    if(plan->results_count == plan->results_capacity) {
+        plan->results_capacity = plan->results_capacity > 0 ? 2 * plan->results_capacity : 64;
+        plan->results = (BatchResult *) realloc(plan->results, sizeof(BatchResult) * plan->results_capacity);
+    }
+    memset(&plan->results[plan->results_count], 0, sizeof(BatchResult));
+    plan->results[plan->results_count].image_path = strdup(image_path);
+    plan->results_count++;
+}
+
+int add_batch_argument(BatchPlan *plan, const char *argument) {
+    // "@list.txt" is a file with one image path per line ("@-" reads stdin).
+    // Anything with * ? [ is a glob, in case the shell didn't expand it.
+    if(argument[0] == '@') {
+        FILE *list = strcmp(argument + 1, "-") == 0 ? stdin : fopen(argument + 1, "r");
+        if(list == NULL) {
+            fprintf(stderr, "Error: Could not open image list %s\n", argument + 1);
+            return -1;
+        }
+
+        char line[PATH_MAX];
+        while(fgets(line, sizeof(line), list) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if(line[0] != '\0') add_batch_image(plan, line);
+        }
+        if(list != stdin) fclose(list);
+        return 0;
+    }
+
+    if(strpbrk(argument, "*?[") != NULL) {
+        glob_t matches;
+        if(glob(argument, 0, NULL, &matches) != 0) {
+            fprintf(stderr, "Error: No images match %s\n", argument);
+            return -1;
+        }
+        for(size_t i = 0; i < matches.gl_pathc; i++) {
+            add_batch_image(plan, matches.gl_pathv[i]);
+        }
+        globfree(&matches);
+        return 0;
+    }
+
+    add_batch_image(plan, argument);
+    return 0;
+}
+
+void scan_one_image(int job_index, void *context) {
+    BatchPlan *plan = (BatchPlan *) context;
+    BatchResult *result = &plan->results[job_index];
+
+    // Per-entry records aren't printed in batch mode, so the output buffer just stays in memory.
+    OutputBuffer out = { -1, NULL, 0, 0 };
+    Fat12Volume volume;
+    init_volume(&volume, &out);
+
+    result->totals.format = FORMAT_SUMMARY;
+    if(load_volume(&volume, (unsigned char *) result->image_path) != 0 ||
+       collect_volume_totals(&volume, &result->totals) != 0) {
+        result->status = -1;
+    }
+
+    close_disk_img(&volume);
+    free(out.data);
+}
+
+void print_batch_result(OutputBuffer *out, OutputFormat format, const BatchResult *result) {
+    const ListingTotals *totals = &result->totals;
+    const char *status = result->status == 0 ? "ok" : "error";
+
+    if(format == FORMAT_JSON) {
+        out_printf(out, "{\"type\":\"image\",\"image\":");
+        out_json_string(out, result->image_path);
+        out_printf(out, ",\"status\":\"%s\",\"volume_label\":", status);
+        out_json_string(out, totals->volume_label);
+        out_printf(out, ",\"files\":%d,\"directories\":%d,\"bytes\":%llu,\"clusters\":%d,\"free_clusters\":%d}\n",
+                totals->files_count, totals->directories_count, (unsigned long long) totals->bytes_count,
+                totals->clusters_count, totals->free_clusters_count);
+    } else if(format == FORMAT_CSV) {
+        out_csv_string(out, result->image_path);
+        out_printf(out, ",%s,", status);
+        out_csv_string(out, totals->volume_label);
+        out_printf(out, ",%d,%d,%llu,%d,%d\n",
+                totals->files_count, totals->directories_count, (unsigned long long) totals->bytes_count,
+                totals->clusters_count, totals->free_clusters_count);
+    } else {
+        out_printf(out, "%-5s %8d %8d %12llu %8d %8d  %s\n", status,
+                totals->files_count, totals->directories_count, (unsigned long long) totals->bytes_count,
+                totals->clusters_count, totals->free_clusters_count, result->image_path);
+    }
+}
+
+int scan_batch(int arguments_count, const char **arguments, OutputFormat format) {
+    BatchPlan plan = { 0 };
+
+    int status = 0;
+    for(int i = 0; i < arguments_count; i++) {
+        if(add_batch_argument(&plan, arguments[i]) != 0) status = 1;
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    run_in_parallel(plan.results_count, scan_one_image, &plan);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    if(format == FORMAT_CSV) {
+        out_printf(&output, "image,status,volume_label,files,directories,bytes,clusters,free_clusters\n");
+    } else if(format != FORMAT_JSON) {
+        out_printf(&output, "%-5s %8s %8s %12s %8s %8s  %s\n", "", "FILES", "DIRS", "BYTES", "CLUSTERS", "FREE", "IMAGE");
+    }
+
+    int failed_count = 0;
+    ListingTotals aggregate = { FORMAT_SUMMARY };
+    for(int i = 0; i < plan.results_count; i++) {
+        const BatchResult *result = &plan.results[i];
+        print_batch_result(&output, format, result);
+
+        if(result->status != 0) {
+            failed_count++;
+            continue;
+        }
+        aggregate.files_count += result->totals.files_count;
+        aggregate.directories_count += result->totals.directories_count;
+        aggregate.bytes_count += result->totals.bytes_count;
+        aggregate.clusters_count += result->totals.clusters_count;
+        aggregate.free_clusters_count += result->totals.free_clusters_count;
+    }
+
+    if(format == FORMAT_JSON) {
+        out_printf(&output, "{\"type\":\"aggregate\",\"images\":%d,\"failed\":%d,\"files\":%d,\"directories\":%d,"
+                "\"bytes\":%llu,\"clusters\":%d,\"free_clusters\":%d,\"threads\":%d,\"seconds\":%.6f}\n",
+                plan.results_count, failed_count, aggregate.files_count, aggregate.directories_count,
+                (unsigned long long) aggregate.bytes_count, aggregate.clusters_count, aggregate.free_clusters_count,
+                count_worker_threads(plan.results_count), seconds);
+    } else if(format != FORMAT_CSV) {
+        out_printf(&output, "\n");
+        out_printf(&output, "Images              : %d (%d failed)\n", plan.results_count, failed_count);
+        out_printf(&output, "Files               : %d\n", aggregate.files_count);
+        out_printf(&output, "Directories         : %d\n", aggregate.directories_count);
+        out_printf(&output, "Bytes in Files      : %llu\n", (unsigned long long) aggregate.bytes_count);
+        out_printf(&output, "Free Clusters       : %d of %d\n", aggregate.free_clusters_count, aggregate.clusters_count);
+        out_printf(&output, "Threads             : %d\n", count_worker_threads(plan.results_count));
+        out_printf(&output, "Seconds             : %.6f\n", seconds);
+    }
+
+    for(int i = 0; i < plan.results_count; i++) {
+        free((void *) plan.results[i].image_path);
+    }
+    free(plan.results);
+
+    if(failed_count > 0) status = 1;
+    return status;
+}
+
+const char *region_names[REGIONS_COUNT] = { "reserved", "fat", "root_directory", "data" };
+const char *phase_names[PHASES_COUNT] = { "boot_record", "fat", "root_directory", "subdirectories", "chain_walk" };
+
+unsigned long long stat_value(atomic_ullong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void print_io_stats(IoStats *stats, uint64_t total_nanoseconds, int as_json) {
+    // Goes to stderr, so it never mixes with file data from cat or read.
+    // Phase times are added up over every thread, so with workers they can add up to more than the total.
+    if(stats == NULL) return;
+
+    struct rusage usage;
+    long peak_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+
+    if(as_json) {
+        fprintf(stderr, "{\"read_calls\":%llu,\"map_calls\":%llu,\"advise_calls\":%llu,"
+                "\"write_calls\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu,\"regions\":{",
+                stat_value(&stats->read_calls), stat_value(&stats->map_calls),
+                stat_value(&stats->advise_calls), stat_value(&stats->write_calls), stat_value(&stats->bytes_read),
+                stat_value(&stats->bytes_written));
+        for(int i = 0; i < REGIONS_COUNT; i++) {
+            fprintf(stderr, "%s\"%s\":{\"bytes\":%llu,\"accesses\":%llu}", i > 0 ? "," : "", region_names[i],
+                    stat_value(&stats->region_bytes[i]), stat_value(&stats->region_accesses[i]));
+        }
+        fprintf(stderr, "},\"chains_resolved\":%llu,\"clusters_followed\":%llu,\"extent_hint_hits\":%llu,"
+                "\"extent_hint_misses\":%llu,\"phase_nanoseconds\":{",
+                stat_value(&stats->chains_resolved), stat_value(&stats->clusters_followed),
+                stat_value(&stats->extent_hint_hits), stat_value(&stats->extent_hint_misses));
+        for(int i = 0; i < PHASES_COUNT; i++) {
+            fprintf(stderr, "%s\"%s\":%llu", i > 0 ? "," : "", phase_names[i], stat_value(&stats->phase_nanoseconds[i]));
+        }
+        fprintf(stderr, ",\"total\":%llu},\"peak_rss_kb\":%ld}\n", (unsigned long long) total_nanoseconds, peak_rss_kb);
+        return;
+    }
+
+    char label[32];
+    fprintf(stderr, "\nI/O Stats\n");
+    fprintf(stderr, "%-27s: %llu (%llu bytes)\n", "Read Calls", stat_value(&stats->read_calls), stat_value(&stats->bytes_read));
+    fprintf(stderr, "%-27s: %llu / %llu\n", "Map / Advise Calls", stat_value(&stats->map_calls), stat_value(&stats->advise_calls));
+    fprintf(stderr, "%-27s: %llu (%llu bytes)\n", "Write Calls", stat_value(&stats->write_calls), stat_value(&stats->bytes_written));
+    for(int i = 0; i < REGIONS_COUNT; i++) {
+        snprintf(label, sizeof(label), "Bytes Read (%s)", region_names[i]);
+        fprintf(stderr, "%-27s: %llu in %llu accesses\n", label,
+                stat_value(&stats->region_bytes[i]), stat_value(&stats->region_accesses[i]));
+    }
+    fprintf(stderr, "%-27s: %llu (%llu clusters followed)\n", "Chains Resolved",
+            stat_value(&stats->chains_resolved), stat_value(&stats->clusters_followed));
+    fprintf(stderr, "%-27s: %llu of %llu\n", "Extent Hint Hits", stat_value(&stats->extent_hint_hits),
+            stat_value(&stats->extent_hint_hits) + stat_value(&stats->extent_hint_misses));
+    for(int i = 0; i < PHASES_COUNT; i++) {
+        snprintf(label, sizeof(label), "Time (%s)", phase_names[i]);
+        fprintf(stderr, "%-27s: %.3f ms\n", label, stat_value(&stats->phase_nanoseconds[i]) / 1e6);
+    }
+    fprintf(stderr, "%-27s: %.3f ms\n", "Time (total)", total_nanoseconds / 1e6);
+    fprintf(stderr, "%-27s: %ld kB\n", "Peak RSS", peak_rss_kb);
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [--audit] [--format=json|csv|summary] <image_file_path>\n", program);
+    printf("       Any command also takes --stats, which prints I/O counters and phase times to stderr.\n");
+    printf("       %s [--format=json|csv] <image_file_path> ls <path>\n", program);
+    printf("       %s <image_file_path> stat|cat <path>\n", program);
+    printf("       %s <image_file_path> read <path> <offset> <length>\n", program);
+    printf("       %s [--format=json] <image_file_path> analyze\n", program);
+    printf("       %s [--threads=N] [--format=json] <image_file_path> grep <text>\n", program);
+    printf("       %s [--threads=N] [--format=json] <image_file_path> manifest\n", program);
+    printf("       %s [--threads=N] [--format=json] diff <image_a> <image_b>\n", program);
+    printf("       %s <image_file_path> tree [<path>]\n", program);
+    printf("       %s <image_file_path> query < queries (one of ls|stat|tree|du [<path>], find <text> per line)\n", program);
+    printf("       %s [--threads=N] <image_file_path> extract <output_directory>\n", program);
+    printf("       %s [--threads=N] [--format=json|csv] batch <image|glob|@list>...\n", program);
+    printf("       %s <image_file_path> put <host_file> <path> [<host_file> <path>]...\n", program);
+    printf("       %s <image_file_path> import <host_directory> <path> [<host_directory> <path>]...\n", program);
+    printf("       %s <image_file_path> mkdir|rm <path>...\n", program);
+    printf("       %s --stream [--format=json|csv|summary] [extract <output_directory>] < image\n", program);
+    printf("       %s mkimage <output_image> <bootloader.bin> [<host_directory> <path>]...\n", program);
+    printf("       %s mkbench <output_image> fragmented|full-root|deep|long-names|fill <seed>\n", program);
+}
+
+int main(int argc, unsigned char *argv[]) {
+    // With just the image, dump the whole volume (or list it with --format).
+    // With a command and a path, only that path is looked up.
+    OutputFormat format = FORMAT_DUMP;
+    int full_slot_audit = 0;
+    int is_streaming = 0;
+    IoStats io_stats = { 0 };
+    uint64_t started = monotonic_nanoseconds();
+    const char **positional = (const char **) malloc(sizeof(char *) * argc);
+    int positional_count = 0;
+
+    for(int i = 1; i < argc; i++) {
+        const char *argument = (const char *) argv[i];
+
+        if(strncmp(argument, "--format=", 9) == 0) {
+            const char *name = argument + 9;
+            if(strcmp(name, "json") == 0) format = FORMAT_JSON;
+            else if(strcmp(name, "csv") == 0) format = FORMAT_CSV;
+            else if(strcmp(name, "summary") == 0) format = FORMAT_SUMMARY;
+            else positional_count = -argc;
+        } else if(strcmp(argument, "--audit") == 0) {
+            full_slot_audit = 1;
+        } else if(strcmp(argument, "--stream") == 0) {
+            is_streaming = 1;
+        } else if(strcmp(argument, "--stats") == 0) {
+            active_io_stats = &io_stats;
+        } else if(strncmp(argument, "--threads=", 10) == 0) {
+            threads_override = atoi(argument + 10);
+            if(threads_override <= 0) positional_count = -argc;
+        } else if(strncmp(argument, "--", 2) == 0) {
+            positional_count = -argc;
+        } else {
+            if(positional_count >= 0) positional[positional_count] = argument;
+            positional_count++;
+        }
+    }
+
+    int status = 0;
+    if(positional_count >= 2 && strcmp(positional[0], "batch") == 0) {
+        status = scan_batch(positional_count - 1, positional + 1, format);
+        out_flush(&output);
+        print_io_stats(active_io_stats, monotonic_nanoseconds() - started, format == FORMAT_JSON);
+        free(positional);
+        return status;
+    }
+
+    // --stream reads the image from stdin, front to back. It lists the entries (as JSON unless
+    // --format says otherwise), or extracts them.
+    if(is_streaming) {
+        if(positional_count == 0 || (positional_count == 2 && strcmp(positional[0], "extract") == 0)) {
+            Fat12Volume volume;
+            init_volume(&volume, &output);
+            status = stream_volume(&volume, STDIN_FILENO, positional_count == 2 ? positional[1] : NULL,
+                    format == FORMAT_DUMP ? FORMAT_JSON : format);
+            close_disk_img(&volume);
+        } else {
+            print_usage((const char *) argv[0]);
+            status = 1;
+        }
+        out_flush(&output);
+        print_io_stats(active_io_stats, monotonic_nanoseconds() - started, format == FORMAT_JSON);
+        free(positional);
+        return status;
+    }
+
+    // diff reads two images.
+    if(positional_count == 3 && strcmp(positional[0], "diff") == 0) {
+        Fat12Volume before, after;
+        init_volume(&before, &output);
+        init_volume(&after, &output);
+        status = load_volume(&before, (unsigned char *) positional[1]) != 0 || load_volume(&after, (unsigned char *) positional[2]) != 0
+            ? 2 : diff_volumes(&before, &after, format);
+        close_disk_img(&before);
+        close_disk_img(&after);
+        out_flush(&output);
+        print_io_stats(active_io_stats, monotonic_nanoseconds() - started, format == FORMAT_JSON);
+        free(positional);
+        return status;
+    }
+
+    // mkimage and mkbench don't read an image, they make one.
+    int is_mkimage = positional_count >= 3 && positional_count % 2 == 1 && strcmp(positional[0], "mkimage") == 0;
+    int is_mkbench = positional_count == 4 && strcmp(positional[0], "mkbench") == 0;
+    if(is_mkimage || is_mkbench) {
+        Fat12Volume volume;
+        init_volume(&volume, &output);
+        status = is_mkimage
+            ? make_image(&volume, positional[1], positional[2], positional_count - 3, positional + 3)
+            : make_synthetic_image(&volume, positional[1], positional[2], positional[3]);
+        close_disk_img(&volume);
+        out_flush(&output);
+        print_io_stats(active_io_stats, monotonic_nanoseconds() - started, format == FORMAT_JSON);
+        free(positional);
+        return status;
+    }
+
+    // Most commands take one argument. analyze and query take none, tree takes an optional path, read takes three.
+    const char *command = positional_count >= 2 ? positional[1] : NULL;
+    int is_known_command = command != NULL && (
+        (positional_count == 3 && (strcmp(command, "ls") == 0 || strcmp(command, "stat") == 0 ||
+                                   strcmp(command, "cat") == 0 || strcmp(command, "extract") == 0)) ||
+        (positional_count == 2 && (strcmp(command, "analyze") == 0 || strcmp(command, "query") == 0 || strcmp(command, "tree") == 0)) ||
+        (positional_count == 2 && strcmp(command, "manifest") == 0) ||
+        (positional_count == 3 && (strcmp(command, "tree") == 0 || strcmp(command, "grep") == 0)) ||
+        (positional_count == 5 && strcmp(command, "read") == 0));
+
+    // Write commands take any number of arguments. put and import take them in pairs.
+    int is_write_command = command != NULL && (
+        (positional_count >= 4 && positional_count % 2 == 0 && (strcmp(command, "put") == 0 || strcmp(command, "import") == 0)) ||
+        (positional_count >= 3 && (strcmp(command, "mkdir") == 0 || strcmp(command, "rm") == 0)));
+
+    if (positional_count != 1 && !is_known_command && !is_write_command) {
+        print_usage((const char *) argv[0]);
+        free(positional);
+        return 1;
+    }
+    
+    Fat12Volume volume_storage;
+    Fat12Volume *volume = &volume_storage;
+    init_volume(volume, &output);
+    volume->full_slot_audit = full_slot_audit;
+
+    unsigned char *image_path = (unsigned char *) positional[0];
+    if(command == NULL && format == FORMAT_DUMP) out_printf(volume->out, "\nImage file path: %s\n\n", image_path);
+
+    int load_status = is_write_command ? load_volume_for_writing(volume, image_path) : load_volume(volume, image_path);
+    if(load_status != 0) {
+        status = 1;
+    } else if(is_write_command) {
+        status = write_volume(volume, command, positional_count - 2, positional + 2);
+    } else if(command == NULL && format == FORMAT_DUMP) {
+        print_boot_drive_section(volume);
+        status = read_root_directory_section(volume) != 0;
+    } else if(command == NULL) {
+        status = list_volume(volume, format);
+    } else if(strcmp(command, "ls") == 0) {
+        status = ls_path(volume, positional[2], format);
+    } else if(strcmp(command, "stat") == 0) {
+        status = stat_path(volume, positional[2]);
+    } else if(strcmp(command, "extract") == 0) {
+        status = extract_volume(volume, positional[2]);
+    } else if(strcmp(command, "analyze") == 0) {
+        status = analyze_volume(volume, format);
+    } else if(strcmp(command, "manifest") == 0) {
+        status = manifest_volume(volume, format);
+    } else if(strcmp(command, "grep") == 0) {
+        status = grep_volume(volume, positional[2], format);
+    } else if(strcmp(command, "query") == 0) {
+        status = query_volume(volume, stdin);
+    } else if(strcmp(command, "tree") == 0) {
+        status = print_volume_tree(volume, positional_count == 3 ? positional[2] : "/");
+    } else if(strcmp(command, "read") == 0) {
+        status = read_path_range(volume, positional[2], positional[3], positional[4]);
+    } else {
+        status = cat_path(volume, positional[2]);
+    }
+    out_flush(volume->out);
+    close_disk_img(volume);
+    print_io_stats(active_io_stats, monotonic_nanoseconds() - started, format == FORMAT_JSON);
+    free(positional);
+    
+    return status;
 }
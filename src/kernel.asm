@@ -0,0 +1,44 @@
+org 0
+bits 16
+
+; KERNEL.BIN: what the bootloader loads, at 1000:0000.
+; Doesn't do much yet: says hello and stops. Under QEMU with isa-debug-exit on port 0xF4
+; it also ends QEMU, so make boot-bench can time boot-to-kernel.
+main:
+    mov ax, cs
+    mov ds, ax
+
+    mov si, msg_hello
+    call puts
+
+    ; QEMU exits with (0x10 << 1) | 1 = 33. Without isa-debug-exit (or on real hardware) nothing's on the port.
+    mov al, 0x10
+    out 0xF4, al
+
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+puts:
+
+.loop:
+    lodsb
+    test al, al
+    jz .done
+
+    mov ah, 0x0E
+    mov bh, 0
+    int 0x10
+
+    jmp .loop
+
+.done:
+    ret
+
+msg_hello: db "Hello from the kernel!", 0X0D, 0X0A, 0
+
+; Pads the kernel out to KERNEL_SIZE bytes, so the benchmark can time loading bigger kernels.
+%ifdef KERNEL_SIZE
+times KERNEL_SIZE - ($ - $$) db 0
+%endif
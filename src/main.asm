@@ -1,6 +1,12 @@
 org 0x7C00
 bits 16
 
+; Stage 1: finds KERNEL.BIN in the root directory, loads it at KERNEL_SEGMENT:0 and jumps to it.
+; The FAT is read into memory once, and every run of contiguous clusters is read with as few
+; int 13h calls as possible: one per track, instead of one per sector.
+KERNEL_SEGMENT  equ 0x1000      ; Linear 0x10000. Up to 64 KiB, since floppy DMA can't cross 0x20000.
+BUFFER          equ 0x7E00      ; Right after us. Holds the root directory, then the FAT (at most 12 sectors).
+
 ; Skip over non-code data
 jmp short main
 nop
@@ -28,21 +34,240 @@ volume_id:              db 0xDE, 0xAD, 0xBE, 0xEF
 volume_label:           db "Hello World"
 system_identifier:      db "FAT12   "
 
-; prints hello world to TTY
-; Refer: https://github.com/TarunNoone/HelloWorldOS
 main:
-    mov ax, 0
+    ; Some BIOSes jump to 07C0:0000 instead of 0000:7C00. Same place, but org assumes cs = 0.
+    jmp 0:.start
+
+.start:
+    xor ax, ax
     mov ds, ax
     mov es, ax
 
     mov ss, ax
     mov sp, 0x7C00
 
-    mov si, msg_hello_world
+    ; The BIOS tells us which drive we booted from in dl
+    mov [drive_number], dl
+
+    mov si, msg_loading
     call puts
 
-    cli  
-    hlt  
+    ; Root directory starts after the reserved sectors and the FATs
+    mov al, [fat_count]
+    cbw
+    mul word [sectors_per_fat]
+    add ax, [reserved_sectors]
+    xchg ax, bx                     ; bx = root directory LBA
+
+    ; Root directory size in sectors, rounded up
+    mov ax, [dir_entries_count]
+    shl ax, 5
+    add ax, [bytes_per_sector]
+    dec ax
+    xor dx, dx
+    div word [bytes_per_sector]
+    xchg ax, cx                     ; cx = root directory sectors
+
+    ; Data area (cluster 2) comes right after the root directory
+    mov ax, bx
+    add ax, cx
+    mov [data_lba], ax
+
+    mov ax, bx
+    mov bx, BUFFER
+    call read_sectors
+
+    ; Look for the kernel's 8.3 name. Deleted entries start with 0xE5, so they never match.
+    push ds
+    pop es
+    mov cx, [dir_entries_count]
+    mov di, BUFFER
+
+.find_kernel:
+    push cx
+    push di
+    mov si, kernel_name
+    mov cx, 11
+    repe cmpsb
+    pop di
+    pop cx
+    jne .next_entry
+
+    ; Same name, but a directory or the volume label isn't it
+    test byte [di + 11], 0x18
+    jz .found_kernel
+
+.next_entry:
+    add di, 32
+    loop .find_kernel
+    jmp boot_failed
+
+.found_kernel:
+    ; First cluster is at offset 26 of the entry. A file with no clusters has nothing to boot.
+    push word [di + 26]
+
+    ; Cache the whole (first) FAT. It overwrites the root directory, which isn't needed anymore.
+    mov ax, [reserved_sectors]
+    mov cx, [sectors_per_fat]
+    mov bx, BUFFER
+    call read_sectors
+
+    mov ax, KERNEL_SEGMENT
+    mov es, ax
+    xor bx, bx
+    pop ax                          ; ax = first cluster. 0 is an empty file, 0xFF0 and up aren't data.
+    cmp ax, 2
+    jb boot_failed
+    cmp ax, 0xFF0
+    jae boot_failed
+
+.next_run:
+    ; Follow the chain while the next cluster is the one right after, so the whole run is one read.
+    mov di, ax                      ; di = first cluster of the run
+    xor cx, cx                      ; cx = clusters in the run
+
+.extend_run:
+    inc cx
+    mov dx, ax
+    call next_cluster
+    inc dx
+    cmp ax, dx
+    je .extend_run
+
+    ; A free (0), reserved (0xFF0 - 0xFF6) or bad (0xFF7) cluster means the chain is broken
+    cmp ax, 2
+    jb boot_failed
+    cmp ax, 0xFF0
+    jb .chain_ok
+    cmp ax, 0xFF8
+    jb boot_failed
+
+.chain_ok:
+
+    push ax                         ; cluster after the run
+
+    ; LBA = data_lba + (cluster - 2) * sectors_per_cluster
+    xor ax, ax
+    mov al, [sectors_per_cluster]
+    mov si, ax
+    mul cx
+    xchg ax, cx                     ; cx = sectors in the run
+
+    ; Stop at 64 KiB, before floppy DMA would. Also ends a chain that loops back on itself.
+    mov ax, [bytes_per_sector]
+    shr ax, 4
+    mul cx
+    jc boot_failed
+    mov dx, es
+    add ax, dx
+    jc boot_failed
+    cmp ax, KERNEL_SEGMENT + 0x1000
+    ja boot_failed
+
+    lea ax, [di - 2]
+    mul si
+    add ax, [data_lba]
+    call read_sectors
+
+    pop ax
+    cmp ax, 0xFF8                   ; 0xFF8 - 0xFFF is the end of the chain
+    jb .next_run
+
+    ; Kernel gets the boot drive in dl, like we did
+    mov dl, [drive_number]
+    jmp KERNEL_SEGMENT:0
+
+; Next cluster in the chain, from the cached FAT.
+; ax = cluster -> ax = next cluster. Clobbers si.
+next_cluster:
+    ; FAT12 entries are 12 bits, so cluster n starts at byte n * 3 / 2
+    mov si, ax
+    shr si, 1
+    add si, ax
+    test al, 1
+    mov ax, [BUFFER + si]
+    jz .even
+
+    ; Odd clusters are the high 12 bits of the word
+    shr ax, 4
+
+.even:
+    and ah, 0x0F
+    ret
+
+; Reads cx sectors starting at LBA ax into es:bx. Each int 13h call reads up to the end of
+; the current track, so a contiguous run costs one call per track, not one per sector.
+; Advances es past the data read. Clobbers ax, cx, dx, si, bp.
+read_sectors:
+    push ax
+    push cx
+
+    ; LBA -> sector in the track
+    xor dx, dx
+    div word [sectors_per_track]    ; ax = LBA / sectors_per_track, dx = LBA % sectors_per_track
+
+    ; Read up to the end of this track, or fewer if that's all we need
+    mov si, [sectors_per_track]
+    sub si, dx
+    cmp si, cx
+    jb .count_set
+    mov si, cx
+
+.count_set:
+    inc dx
+    mov cl, dl                      ; sector, 1-based
+
+    ; Track -> cylinder and head
+    xor dx, dx
+    div word [heads]
+    mov ch, al                      ; cylinder. A floppy never goes past 255, so no high bits in cl.
+    mov dh, dl                      ; head
+    mov dl, [drive_number]
+
+    mov ax, si                      ; al = sectors to read
+    mov ah, 0x02
+    mov bp, 3                       ; Floppies fail now and then (motor spin up). Try 3 times.
+
+.retry:
+    pusha
+    stc                             ; Some BIOSes don't set CF on errors
+    int 0x13
+    popa
+    jnc .read_done
+
+    ; Reset the disk system and try again
+    pusha
+    xor ax, ax
+    int 0x13
+    popa
+    dec bp
+    jnz .retry
+    jmp boot_failed
+
+.read_done:
+    ; es += sectors * bytes_per_sector / 16, so bx never wraps
+    mov ax, [bytes_per_sector]
+    shr ax, 4
+    mul si
+    mov dx, es
+    add dx, ax
+    mov es, dx
+
+    pop cx
+    pop ax
+    add ax, si
+    sub cx, si
+    jnz read_sectors
+    ret
+
+boot_failed:
+    mov si, msg_boot_failed
+    call puts
+
+.halt:
+    cli
+    hlt
+    jmp .halt
 
 puts:
 
@@ -58,12 +283,12 @@ puts:
     jmp .loop
 
 .done:
-    ret 
-
-.halt:
-    jmp .halt
+    ret
 
-msg_hello_world: db "Hello World!!!", 0X0D, 0X0A, 0
+msg_loading:     db "Loading", 0X0D, 0X0A, 0
+msg_boot_failed: db "Boot failed", 0X0D, 0X0A, 0
+kernel_name:     db "KERNEL  BIN"
+data_lba:        dw 0
 
-times 510 - ($ - $$) db 0  
-dw 55AAh                                                                    
+times 510 - ($ - $$) db 0
+dw 55AAh
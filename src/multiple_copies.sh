@@ -1,4 +1,12 @@
 #!/bin/bash
-for i in {1..223}; do
-    mcopy -i bin/floppy.img bin/lore.txt "::lore${i}.txt"
+# Used to be one mcopy per copy. Now every copy goes in with a single put, and a single flush.
+# put writes everything or nothing, so only ask for as many copies as there are Root Directory slots left.
+# Used slots are counted straight from the Root Directory (sectors 19 - 32 on a 1.44 MB floppy), so long name
+# entries and the volume label count too. Anything but free (0x00) or deleted (0xE5) is in use.
+# Each copy takes one slot: lore<N>.txt is 8.3, and all lowercase is kept with the NT case flags, not a long name.
+used=$(dd if=bin/floppy.img bs=512 skip=19 count=14 status=none | od -An -v -tu1 -w32 | awk '$1 != 0 && $1 != 229' | wc -l)
+arguments=()
+for ((i = 1; i <= 224 - used; i++)); do
+    arguments+=(bin/lore.txt "/lore${i}.txt")
 done
+bin/fat_12_disk_reader bin/floppy.img put "${arguments[@]}"